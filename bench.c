@@ -0,0 +1,293 @@
+// In-process benchmarks of the request path, without sockets.
+//
+// Usage: fw_bench [max-rules] [seconds-per-benchmark]
+//
+// Links server.c built with FW_NO_MAIN and runs process_request, the A/D
+// and C argument parsers and the C matching loop against synthetic rule
+// sets of 10, 1k, 100k and 1M rules, with no recorded queries and with up
+// to 100k accepted queries. C records the checks it accepts, so every
+// benchmark starts on a rule set built afresh and queries= is the count
+// recorded when it starts. The random inputs are seeded the same way every
+// run. Every result is one line in the Go benchmark format, so runs from
+// two revisions can be compared with benchstat or a diff:
+//
+//   BenchmarkCheckQuery/rules=1000/queries=0  2000000  85.1 ns/op  0.00 allocs/op
+//
+// Allocations are counted by wrapping malloc, calloc and realloc at link
+// time; allocations made inside the C library are not seen.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_helper.h"
+#include "rule_set.h"
+#include "stats.h"
+
+
+#define QUERY_POOL 65536          // distinct checks cycled through
+#define RECORDED_QUERIES 100000   // history of the second pass
+
+
+static uint64_t allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+   allocations++;
+   return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+   allocations++;
+   return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+   allocations++;
+   return __real_realloc(p, size);
+}
+
+
+typedef struct BenchQuery
+{
+   uint32_t ip;
+   uint16_t port;
+   char text[48];    // "<ip> <port>"
+} BenchQuery;
+
+
+#define SEED 0x9E3779B97F4A7C15ull
+
+static uint64_t rng = SEED;
+static double benchSeconds = 0.5;
+static char ruleTexts[QUERY_POOL][64];
+static BenchQuery queries[QUERY_POOL];
+
+
+// xorshift64*
+static uint64_t next_random(void)
+{
+   rng ^= rng >> 12;
+   rng ^= rng << 25;
+   rng ^= rng >> 27;
+   return rng * 2685821657736338717ull;
+}
+
+
+static void format_ip(char* out, uint32_t ip)
+{
+   sprintf(out, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+}
+
+
+// Writes a random rule within 10.0.0.0/8 to text
+static void random_rule(char* text, size_t size)
+{
+   uint32_t lo = (10u << 24) | (uint32_t)(next_random() & 0xFFFFFF);
+   uint32_t hi = lo + (uint32_t)(next_random() % 1024);
+   int port = (int)(next_random() % 60000);
+   char a[16], b[16];
+   format_ip(a, lo);
+   format_ip(b, hi > lo ? hi : lo);
+   snprintf(text, size, "%s-%s %d-%d", a, b, port, port + (int)(next_random() % 64));
+}
+
+
+// Replaces the rule set with n random rules
+static void build_rules(size_t n)
+{
+   rule_set_clear();
+   FwRule** rules = malloc(n * sizeof(FwRule*));
+   if (rules == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (size_t i = 0; i < n; i++) {
+       char text[64];
+       FwRule parsed;
+       random_rule(text, sizeof(text));
+       process_rule_cmd(text, &parsed);
+       rules[i] = rule_set_new_rule(&parsed);
+   }
+   rule_set_add_batch(rules, n);
+   free(rules);
+}
+
+
+// Half the checks fall inside a current rule, half anywhere in 10.0.0.0/8
+static void make_queries(void)
+{
+   const RuleSet* rs = rule_set_acquire();
+   for (size_t i = 0; i < QUERY_POOL; i++) {
+       BenchQuery* q = &queries[i];
+       if (i % 2 == 0 && rs->table.count > 0) {
+           size_t r = next_random() % rs->table.count;
+           uint32_t width = rs->table.ip_hi[r] - rs->table.ip_lo[r] + 1;
+           q->ip = rs->table.ip_lo[r] + (uint32_t)(next_random() % width);
+           q->port = rs->table.port_lo[r];
+       } else {
+           q->ip = (10u << 24) | (uint32_t)(next_random() & 0xFFFFFF);
+           q->port = (uint16_t)(next_random() % 60000);
+       }
+       char ip[16];
+       format_ip(ip, q->ip);
+       snprintf(q->text, sizeof(q->text), "%s %u", ip, q->port);
+   }
+   rule_set_release();
+}
+
+
+typedef void (*BenchFn)(uint64_t i, FwBuf* out);
+
+
+// Runs fn in growing batches until it has taken benchSeconds, then prints
+// the result line
+static void run_bench(const char* name, size_t rules, size_t recorded, BenchFn fn)
+{
+   FwBuf out;
+   buf_init(&out);
+   uint64_t ops = 0, elapsed = 0, allocs = 0;
+   for (uint64_t batch = 1; elapsed < benchSeconds * 1e9; batch *= 2) {
+       uint64_t a0 = allocations;
+       uint64_t t0 = stats_now();
+       for (uint64_t i = 0; i < batch; i++) {
+           out.len = 0;
+           fn(ops + i, &out);
+       }
+       elapsed += stats_now() - t0;
+       allocs += allocations - a0;
+       ops += batch;
+   }
+   printf("Benchmark%s/rules=%zu/queries=%zu\t%llu\t%.1f ns/op\t%.2f allocs/op\n",
+          name, rules, recorded, (unsigned long long)ops,
+          (double)elapsed / ops, (double)allocs / ops);
+   fflush(stdout);
+   buf_free(&out);
+}
+
+
+static void bench_parse_rule(uint64_t i, FwBuf* out)
+{
+   char text[64];
+   strcpy(text, ruleTexts[i % QUERY_POOL]);
+   FwRule fwRule;
+   process_rule_cmd(text, &fwRule);
+}
+
+
+static void bench_parse_query(uint64_t i, FwBuf* out)
+{
+   FwQuery fwQuery;
+   process_query_cmd(queries[i % QUERY_POOL].text, &fwQuery);
+}
+
+
+static void bench_check_query(uint64_t i, FwBuf* out)
+{
+   const BenchQuery* q = &queries[i % QUERY_POOL];
+   const RuleSet* rs = rule_set_acquire();
+   check_query(rs, q->ip, q->port);
+   rule_set_release();
+}
+
+
+static void bench_request_check(uint64_t i, FwBuf* out)
+{
+   char buffer[MAX_FW_CMD];
+   snprintf(buffer, sizeof(buffer), "C %s", queries[i % QUERY_POOL].text);
+   process_request(buffer, out);
+}
+
+
+// One A and the D that undoes it, so the rule count stays put
+static void bench_request_add_delete(uint64_t i, FwBuf* out)
+{
+   char buffer[MAX_FW_CMD];
+   snprintf(buffer, sizeof(buffer), "A %s", ruleTexts[i % QUERY_POOL]);
+   process_request(buffer, out);
+   buffer[0] = 'D';
+   process_request(buffer, out);
+}
+
+
+static void bench_request_history(uint64_t i, FwBuf* out)
+{
+   char buffer[] = "R";
+   process_request(buffer, out);
+}
+
+
+// Records up to n accepted queries that are not recorded yet and returns
+// how many it recorded; a small rule set may not cover n of them
+static size_t record_queries(size_t n)
+{
+   const RuleSet* rs = rule_set_acquire();
+   size_t done = 0;
+   for (size_t tries = 0; done < n && tries < 4 * n && rs->table.count > 0; tries++) {
+       size_t r = next_random() % rs->table.count;
+       uint32_t width = rs->table.ip_hi[r] - rs->table.ip_lo[r] + 1;
+       uint32_t ports = rs->table.port_hi[r] - rs->table.port_lo[r] + 1;
+       uint32_t ip = rs->table.ip_lo[r] + (uint32_t)(next_random() % width);
+       uint16_t port = rs->table.port_lo[r] + (uint16_t)(next_random() % ports);
+       done += check_query(rs, ip, port);
+   }
+   rule_set_release();
+   return done;
+}
+
+
+// Rebuilds the rule set with n rules and up to target recorded queries,
+// the same way every time. Returns how many queries were recorded.
+static size_t reset_rules(size_t n, size_t target)
+{
+   rng = SEED + n;
+   build_rules(n);
+   make_queries();
+   return record_queries(target);
+}
+
+
+static const struct {
+   const char* name;
+   BenchFn fn;
+} requestBenches[] = {
+   { "CheckQuery", bench_check_query },
+   { "ProcessRequestC", bench_request_check },
+   { "ProcessRequestAD", bench_request_add_delete },
+   { "ProcessRequestR", bench_request_history },
+};
+
+
+int main(int argc, char** argv)
+{
+   size_t maxRules = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+   if (argc > 2) {
+       benchSeconds = atof(argv[2]);
+   }
+   server_init(4096, NULL);
+
+   for (size_t i = 0; i < QUERY_POOL; i++) {
+       random_rule(ruleTexts[i], sizeof(ruleTexts[i]));
+   }
+   make_queries();
+   run_bench("ProcessRuleCmd", 0, 0, bench_parse_rule);
+   run_bench("ProcessQueryCmd", 0, 0, bench_parse_query);
+
+   static const size_t sizes[] = { 10, 1000, 100000, 1000000 };
+   for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= maxRules; s++) {
+       for (size_t target = 0; target <= RECORDED_QUERIES; target += RECORDED_QUERIES) {
+           for (size_t b = 0; b < sizeof(requestBenches) / sizeof(requestBenches[0]); b++) {
+               size_t recorded = reset_rules(sizes[s], target);
+               run_bench(requestBenches[b].name, sizes[s], recorded, requestBenches[b].fn);
+           }
+       }
+   }
+   return 0;
+}
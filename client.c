@@ -1,66 +1,457 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>    // for close
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h> // for socket types
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h> // for gethostbyname
 
+#include "fw_client.h"
+#include "fw_proto.h"
 
-int main(int argc, char *argv[]) {
-   if (argc < 4) {
-       fprintf(stderr,"Usage: %s <serverHost> <serverPort> <command>\n", argv[0]);
+
+// Checks sent per binary frame
+#define CLIENT_BATCH 4096
+// Longest command taken from the command line
+#define MAX_COMMAND 256
+
+
+static void* xrealloc(void* p, size_t size)
+{
+   p = realloc(p, size ? size : 1);
+   if (p == NULL) {
+       printf("Memory allocation failed\n");
        exit(1);
    }
-   char *serverHost = argv[1];
-   int serverPort = atoi(argv[2]);
+   return p;
+}
 
 
-   // Build the command from argv[3] onwards
-   char command[256];
-   strcpy(command, argv[3]);
-   for (int i = 4; i < argc; i++) {
-       strcat(command, " ");
-       strcat(command, argv[i]);
+// Streams newline-delimited commands from stdin over one connection without
+// waiting for replies, printing each response as it arrives. The server ends
+// every response with an empty line, which is dropped from the output.
+void run_stream(int sockfd)
+{
+   struct pollfd fds[2];
+   fds[0].fd = STDIN_FILENO;
+   fds[0].events = POLLIN;
+   fds[1].fd = sockfd;
+   fds[1].events = POLLIN;
+   bool atLineStart = true;
+   char buffer[4096];
+   // The empty line that opens a stream connection
+   write_fully(sockfd, "\n", 1);
+
+
+   while (true) {
+       if (poll(fds, 2, -1) < 0) {
+           perror("ERROR polling");
+           exit(1);
+       }
+
+       if (fds[0].revents & (POLLIN | POLLHUP)) {
+           ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+           if (n <= 0) {
+               // No more commands; the server closes once it has answered
+               shutdown(sockfd, SHUT_WR);
+               fds[0].fd = -1;
+           } else {
+               for (ssize_t off = 0; off < n; ) {
+                   ssize_t w = write(sockfd, buffer + off, n - off);
+                   if (w < 0) {
+                       perror("ERROR writing to socket");
+                       exit(1);
+                   }
+                   off += w;
+               }
+           }
+       }
+
+       if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+           ssize_t n = read(sockfd, buffer, sizeof(buffer));
+           if (n < 0) {
+               perror("ERROR reading from socket");
+               exit(1);
+           }
+           if (n == 0) {
+               break;
+           }
+           for (ssize_t i = 0; i < n; i++) {
+               if (buffer[i] == '\n' && atLineStart) {
+                   continue; // end of one response
+               }
+               putchar(buffer[i]);
+               atLineStart = buffer[i] == '\n';
+           }
+           fflush(stdout);
+       }
    }
+}
+
+
+// Sends the first count checks in frame and prints one verdict per check
+void send_checks(int sockfd, uint8_t* frame, uint32_t count)
+{
+   proto_put_header(frame, FW_FRAME_CHECK, 0, count);
+   write_fully(sockfd, frame, FW_FRAME_HEADER + (size_t)count * FW_CHECK_ENTRY);
+
+   uint8_t reply[FW_FRAME_HEADER + CLIENT_BATCH / 8];
+   read_fully(sockfd, reply, FW_FRAME_HEADER);
+   if (reply[0] != FW_PROTO_MAGIC || reply[1] != FW_FRAME_VERDICT ||
+       proto_get16(reply + 2) != FW_STATUS_OK || proto_get32(reply + 4) != count) {
+       fprintf(stderr, "ERROR, server rejected the frame\n");
+       exit(1);
+   }
+   read_fully(sockfd, reply + FW_FRAME_HEADER, (count + 7) / 8);
+
+   for (uint32_t i = 0; i < count; i++) {
+       const uint8_t* entry = frame + FW_FRAME_HEADER + (size_t)i * FW_CHECK_ENTRY;
+       bool accepted = reply[FW_FRAME_HEADER + i / 8] & (1 << (i % 8));
+       printf("%u.%u.%u.%u %u: %s\n", entry[0], entry[1], entry[2], entry[3],
+              proto_get16(entry + 4), accepted ? "Connection accepted" : "Connection rejected");
+   }
+}
+
+
+// Checks every "<ip> <port>" line of in using binary frames of up to
+// CLIENT_BATCH checks each
+void run_checks(int sockfd, FILE* in)
+{
+   uint8_t* frame = malloc(FW_FRAME_HEADER + CLIENT_BATCH * FW_CHECK_ENTRY);
+   if (frame == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   uint32_t count = 0;
+   char line[256];
+   int lineNo = 0;
+
+   while (fgets(line, sizeof(line), in) != NULL) {
+       lineNo++;
+       int ip[4], port;
+       char extra;
+       if (sscanf(line, "%d.%d.%d.%d %d %c", &ip[0], &ip[1], &ip[2], &ip[3], &port, &extra) != 5 ||
+           ip[0] < 0 || ip[0] > 255 || ip[1] < 0 || ip[1] > 255 ||
+           ip[2] < 0 || ip[2] > 255 || ip[3] < 0 || ip[3] > 255 ||
+           port < 0 || port > 65535) {
+           fprintf(stderr, "Skipping invalid endpoint on line %d\n", lineNo);
+           continue;
+       }
+       uint8_t* entry = frame + FW_FRAME_HEADER + (size_t)count * FW_CHECK_ENTRY;
+       for (int i = 0; i < 4; i++) {
+           entry[i] = (uint8_t)ip[i];
+       }
+       proto_put16(entry + 4, (uint16_t)port);
+       if (++count == CLIENT_BATCH) {
+           send_checks(sockfd, frame, count);
+           count = 0;
+       }
+   }
+   if (count > 0) {
+       send_checks(sockfd, frame, count);
+   }
+   free(frame);
+}
 
 
-   int sockfd;
-   struct sockaddr_in serv_addr;
-   struct hostent *server;
+// One stream connection of a batch run
+typedef struct BatchConn
+{
+   int fd;
+   char* out;          // command lines not yet written
+   size_t outLen;
+   size_t outSent;
+   char* in;           // response bytes not yet matched to a command
+   size_t inLen;
+   size_t inCap;
+   size_t inScanned;   // no response ends before this offset of in
+   size_t* inFlight;   // commands sent and not yet answered, oldest first
+   size_t head;
+   size_t count;
+} BatchConn;
 
 
-   // Create socket
-   sockfd = socket(AF_INET, SOCK_STREAM, 0);
-   if (sockfd < 0) {
-       perror("ERROR opening socket");
+// Splits text into the lines the server answers, dropping the blank ones
+// it ignores. Returns the number of commands; starts and lengths index text.
+size_t split_commands(char* text, size_t len, size_t** starts, size_t** lengths)
+{
+   size_t n = 0, cap = 0;
+   *starts = NULL;
+   *lengths = NULL;
+   for (size_t pos = 0; pos < len; ) {
+       char* nl = memchr(text + pos, '\n', len - pos);
+       size_t end = nl != NULL ? (size_t)(nl - text) : len;
+       size_t lineLen = end - pos;
+       if (lineLen > 0 && text[end - 1] == '\r') {
+           lineLen--;
+       }
+       if (lineLen > 0) {
+           if (n == cap) {
+               cap = cap ? cap * 2 : 1024;
+               *starts = xrealloc(*starts, cap * sizeof(size_t));
+               *lengths = xrealloc(*lengths, cap * sizeof(size_t));
+           }
+           (*starts)[n] = pos;
+           (*lengths)[n] = lineLen;
+           n++;
+       }
+       pos = end + 1;
+   }
+   return n;
+}
+
+
+// Sends every command in in over connections stream connections, keeping
+// up to window of them unanswered on each, and prints the responses in
+// the order of the commands, as -k does. Commands on different
+// connections may run in any order, so commands that depend on earlier
+// ones need a single connection. The wall time and throughput go to
+// stderr.
+void run_batch(const char* serverHost, int serverPort, FILE* in, int connections, int window)
+{
+   // Read every command up front so the timing covers only the exchange
+   char* text = NULL;
+   size_t len = 0, cap = 0;
+   while (true) {
+       if (len == cap) {
+           cap = cap ? cap * 2 : 65536;
+           text = xrealloc(text, cap);
+       }
+       size_t n = fread(text + len, 1, cap - len, in);
+       if (n == 0) {
+           break;
+       }
+       len += n;
+   }
+   size_t *starts, *lengths;
+   size_t total = split_commands(text, len, &starts, &lengths);
+   char** responses = xrealloc(NULL, total * sizeof(char*));
+   size_t* responseLens = xrealloc(NULL, total * sizeof(size_t));
+   bool* answered = calloc(total ? total : 1, sizeof(bool));
+   BatchConn* conns = calloc(connections, sizeof(BatchConn));
+   struct pollfd* fds = calloc(connections, sizeof(struct pollfd));
+   if (answered == NULL || conns == NULL || fds == NULL) {
+       printf("Memory allocation failed\n");
        exit(1);
    }
 
+   struct timespec began, ended;
+   clock_gettime(CLOCK_MONOTONIC, &began);
+   for (int i = 0; i < connections; i++) {
+       conns[i].fd = connect_to_server(serverHost, serverPort);
+       // Writes must not block while the server waits for its responses
+       // to be read
+       fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL, 0) | O_NONBLOCK);
+       conns[i].inFlight = xrealloc(NULL, window * sizeof(size_t));
+       // Opens the stream
+       conns[i].out = xrealloc(NULL, 1);
+       conns[i].out[0] = '\n';
+       conns[i].outLen = 1;
+   }
+
+   size_t next = 0, printed = 0;
+   while (printed < total) {
+       // Hand out commands to every connection with room in its window
+       for (int i = 0; i < connections; i++) {
+           BatchConn* bc = &conns[i];
+           while (bc->count < (size_t)window && next < total) {
+               size_t need = bc->outLen + lengths[next] + 1;
+               bc->out = xrealloc(bc->out, need);
+               memcpy(bc->out + bc->outLen, text + starts[next], lengths[next]);
+               bc->out[need - 1] = '\n';
+               bc->outLen = need;
+               bc->inFlight[(bc->head + bc->count++) % window] = next++;
+           }
+           fds[i].fd = bc->fd;
+           fds[i].events = (bc->count > 0 ? POLLIN : 0) | (bc->outSent < bc->outLen ? POLLOUT : 0);
+       }
+       if (poll(fds, connections, -1) < 0) {
+           perror("ERROR polling");
+           exit(1);
+       }
+
+       for (int i = 0; i < connections; i++) {
+           BatchConn* bc = &conns[i];
+           if (fds[i].revents & POLLOUT) {
+               ssize_t w = write(bc->fd, bc->out + bc->outSent, bc->outLen - bc->outSent);
+               if (w < 0) {
+                   perror("ERROR writing to socket");
+                   exit(1);
+               }
+               bc->outSent += w;
+               if (bc->outSent == bc->outLen) {
+                   bc->outLen = 0;
+                   bc->outSent = 0;
+               }
+           }
+           if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+               continue;
+           }
+           if (bc->inCap - bc->inLen < 4096) {
+               bc->inCap = bc->inCap ? bc->inCap * 2 : 65536;
+               bc->in = xrealloc(bc->in, bc->inCap);
+           }
+           ssize_t n = read(bc->fd, bc->in + bc->inLen, bc->inCap - bc->inLen);
+           if (n < 0) {
+               perror("ERROR reading from socket");
+               exit(1);
+           }
+           if (n == 0) {
+               fprintf(stderr, "ERROR, server closed the connection\n");
+               exit(1);
+           }
+           bc->inLen += n;
 
-   // Get server by name
-   server = gethostbyname(serverHost);
-   if (server == NULL) {
-       fprintf(stderr,"ERROR, no such host\n");
-       exit(0);
+           // Each response ends with an empty line. The search resumes where
+           // the last read's stopped, so a long response is scanned once.
+           size_t pos = 0;
+           while (bc->count > 0) {
+               char* end = NULL;
+               size_t p = bc->inScanned > pos ? bc->inScanned : pos;
+               for (; p + 1 < bc->inLen; p++) {
+                   if (bc->in[p] == '\n' && bc->in[p + 1] == '\n') {
+                       end = bc->in + p;
+                       break;
+                   }
+               }
+               if (end == NULL) {
+                   bc->inScanned = p;
+                   break;
+               }
+               size_t cmd = bc->inFlight[bc->head];
+               bc->head = (bc->head + 1) % window;
+               bc->count--;
+               responseLens[cmd] = end - (bc->in + pos);
+               responses[cmd] = xrealloc(NULL, responseLens[cmd]);
+               memcpy(responses[cmd], bc->in + pos, responseLens[cmd]);
+               answered[cmd] = true;
+               pos = end + 2 - bc->in;
+           }
+           memmove(bc->in, bc->in + pos, bc->inLen - pos);
+           bc->inLen -= pos;
+           bc->inScanned = bc->inScanned > pos ? bc->inScanned - pos : 0;
+       }
+
+       // Print every response whose earlier ones are all out
+       while (printed < total && answered[printed]) {
+           if (responseLens[printed] > 0) {
+               fwrite(responses[printed], 1, responseLens[printed], stdout);
+               putchar('\n');
+           }
+           free(responses[printed]);
+           printed++;
+       }
    }
+   clock_gettime(CLOCK_MONOTONIC, &ended);
+   fflush(stdout);
 
+   double seconds = (ended.tv_sec - began.tv_sec) + (ended.tv_nsec - began.tv_nsec) / 1e9;
+   fprintf(stderr, "%zu commands in %.3f s on %d connections, %d in flight each: %.0f commands/s\n",
+           total, seconds, connections, window, seconds > 0 ? total / seconds : 0.0);
 
-   // Build server address
-   bzero((char *) &serv_addr, sizeof(serv_addr));
-   serv_addr.sin_family = AF_INET;
-   bcopy((char *)server->h_addr_list[0],
-        (char *)&serv_addr.sin_addr.s_addr,
-        server->h_length);
-   serv_addr.sin_port = htons(serverPort);
+   for (int i = 0; i < connections; i++) {
+       close(conns[i].fd);
+       free(conns[i].out);
+       free(conns[i].in);
+       free(conns[i].inFlight);
+   }
+   free(conns);
+   free(fds);
+   free(answered);
+   free(responses);
+   free(responseLens);
+   free(starts);
+   free(lengths);
+   free(text);
+}
 
 
-   // Connect to server
-   if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0) {
-       perror("ERROR connecting");
+int main(int argc, char *argv[]) {
+   char *prog = argv[0];
+   bool stream = false, binary = false, batch = false;
+   int connections = 1, window = 64;
+   int opt;
+   // '+' stops at the host, so a command's arguments are never options
+   while ((opt = getopt(argc, argv, "+kbmc:w:")) != -1) {
+       switch (opt) {
+       case 'k': stream = true; break;
+       case 'b': binary = true; break;
+       case 'm': batch = true; break;
+       case 'c': connections = atoi(optarg); break;
+       case 'w': window = atoi(optarg); break;
+       default:  argc = 0; break;
+       }
+   }
+   argc -= optind - 1;
+   argv += optind - 1;
+   int modes = stream + binary + batch;
+   bool tuned = connections != 1 || window != 64;
+   if (argc < 3 || modes > 1 || (tuned && !batch) || connections < 1 || window < 1 ||
+       (modes == 0 && argc < 4) || (stream && argc != 3) || (binary && argc != 4) ||
+       (batch && argc > 4)) {
+       fprintf(stderr,"Usage: %s <serverHost> <serverPort> <command>\n", prog);
+       fprintf(stderr,"       %s -k <serverHost> <serverPort> < commands\n", prog);
+       fprintf(stderr,"       %s -b <serverHost> <serverPort> <endpoints-file>\n", prog);
+       fprintf(stderr,"       %s -m [-c connections] [-w in-flight] <serverHost> <serverPort> [commands-file]\n", prog);
        exit(1);
    }
+   char *serverHost = argv[1];
+   int serverPort = atoi(argv[2]);
+
+
+   if (stream) {
+       int sockfd = connect_to_server(serverHost, serverPort);
+       run_stream(sockfd);
+       close(sockfd);
+       return 0;
+   }
+
+   if (batch) {
+       FILE* in = argc < 4 || strcmp(argv[3], "-") == 0 ? stdin : fopen(argv[3], "r");
+       if (in == NULL) {
+           perror("ERROR opening commands file");
+           exit(1);
+       }
+       run_batch(serverHost, serverPort, in, connections, window);
+       if (in != stdin) {
+           fclose(in);
+       }
+       return 0;
+   }
+
+   if (binary) {
+       FILE* in = strcmp(argv[3], "-") == 0 ? stdin : fopen(argv[3], "r");
+       if (in == NULL) {
+           perror("ERROR opening endpoints file");
+           exit(1);
+       }
+       int sockfd = connect_to_server(serverHost, serverPort);
+       run_checks(sockfd, in);
+       close(sockfd);
+       if (in != stdin) {
+           fclose(in);
+       }
+       return 0;
+   }
+
+
+   // Build the command from argv[3] onwards
+   char command[MAX_COMMAND];
+   size_t len = 0;
+   for (int i = 3; i < argc; i++) {
+       int n = snprintf(command + len, sizeof(command) - len, "%s%s", i > 3 ? " " : "", argv[i]);
+       if (n < 0 || (size_t)n >= sizeof(command) - len) {
+           fprintf(stderr, "ERROR, command longer than %d bytes\n", MAX_COMMAND - 1);
+           exit(1);
+       }
+       len += n;
+   }
+
+
+   int sockfd = connect_to_server(serverHost, serverPort);
 
 
    // Send command
@@ -71,15 +462,16 @@ int main(int argc, char *argv[]) {
    }
 
 
-   // Read response
-   char buffer[1024];
-   bzero(buffer,1024);
-   n = read(sockfd,buffer,1023);
+   // Read the response until the server closes; listings can be long
+   char buffer[4096];
+   while ((n = read(sockfd, buffer, sizeof(buffer))) > 0) {
+       fwrite(buffer, 1, n, stdout);
+   }
    if (n < 0) {
         perror("ERROR reading from socket");
         exit(1);
    }
-   printf("%s\n",buffer);
+   printf("\n");
 
 
    close(sockfd);
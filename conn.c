@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_helper.h"
+#include "conn.h"
+#include "fw_proto.h"
+#include "stats.h"
+
+
+// A stream client that sends this much without a newline is dropped
+#define MAX_PENDING_INPUT 65536
+// Buffers kept by conn_reset; a rare huge listing does not pin its memory
+#define MAX_KEPT_BUFFER 65536
+
+
+void conn_init(FwConn* conn)
+{
+   buf_init(&conn->in);
+   buf_init(&conn->out);
+   conn->mode = CONN_NEW;
+   conn->eof = false;
+   conn->paused = false;
+   conn->closing = false;
+}
+
+
+void conn_free(FwConn* conn)
+{
+   buf_free(&conn->in);
+   buf_free(&conn->out);
+}
+
+
+void conn_reset(FwConn* conn)
+{
+   if (conn->in.cap > MAX_KEPT_BUFFER) {
+       buf_free(&conn->in);
+   }
+   if (conn->out.cap > MAX_KEPT_BUFFER) {
+       buf_free(&conn->out);
+   }
+   conn->in.len = 0;
+   conn->out.len = 0;
+   conn->mode = CONN_NEW;
+   conn->eof = false;
+   conn->paused = false;
+   conn->closing = false;
+}
+
+
+// Runs one command of len bytes and appends its response
+static void run_command(FwConn* conn, const char* cmd, size_t len)
+{
+   size_t start = conn->out.len;
+   if (len > MAX_FW_CMD - 1) {
+       buf_puts(&conn->out, "Illegal request");
+   } else {
+       char buffer[MAX_FW_CMD + 1];
+       memcpy(buffer, cmd, len);
+       buffer[len] = '\0';
+       uint64_t began = stats_now();
+       process_request(buffer, &conn->out);
+       stats_record(stats_command_hist(buffer[0]), stats_now() - began);
+   }
+
+   if (conn->mode == CONN_STREAM) {
+       // Terminate the response with an empty line
+       if (conn->out.len == start || conn->out.data[conn->out.len - 1] != '\n') {
+           buf_append(&conn->out, "\n", 1);
+       }
+       buf_append(&conn->out, "\n", 1);
+   }
+}
+
+
+// Answers a bad frame and gives up on the connection
+static void reject_frame(FwConn* conn, uint16_t status)
+{
+   uint8_t header[FW_FRAME_HEADER];
+   proto_put_header(header, FW_FRAME_VERDICT, status, 0);
+   buf_append(&conn->out, header, sizeof(header));
+   conn->closing = true;
+}
+
+
+// Runs every complete check frame in conn->in. Entries are decoded in
+// place; the verdict bitmap is written straight into conn->out.
+static void process_frames(FwConn* conn)
+{
+   size_t start = 0;
+   while (conn->in.len - start >= FW_FRAME_HEADER) {
+       if (conn->out.len >= CONN_OUT_HIGH_WATER) {
+           conn->paused = true;
+           break;
+       }
+       const uint8_t* frame = (const uint8_t*)conn->in.data + start;
+       if (frame[0] != FW_PROTO_MAGIC || frame[1] != FW_FRAME_CHECK) {
+           reject_frame(conn, FW_STATUS_BAD_FRAME);
+           return;
+       }
+       uint32_t count = proto_get32(frame + 4);
+       if (count > FW_MAX_CHECKS) {
+           reject_frame(conn, FW_STATUS_TOO_LARGE);
+           return;
+       }
+       size_t size = FW_FRAME_HEADER + (size_t)count * FW_CHECK_ENTRY;
+       if (conn->in.len - start < size) {
+           break;
+       }
+
+       size_t bitmapLen = (count + 7) / 8;
+       uint8_t* reply = (uint8_t*)buf_reserve(&conn->out, FW_FRAME_HEADER + bitmapLen);
+       proto_put_header(reply, FW_FRAME_VERDICT, FW_STATUS_OK, count);
+       uint64_t began = stats_now();
+       process_checks(frame + FW_FRAME_HEADER, count, reply + FW_FRAME_HEADER);
+       stats_record(STAT_FRAME, stats_now() - began);
+       conn->out.len += FW_FRAME_HEADER + bitmapLen;
+       start += size;
+   }
+   buf_consume(&conn->in, start);
+
+   // A frame cut short by the client closing is dropped
+   if (conn->eof && !conn->paused) {
+       conn->closing = true;
+   }
+}
+
+
+void conn_process(FwConn* conn, bool eof)
+{
+   conn->eof |= eof;
+   conn->paused = false;
+   if (conn->closing) {
+       return;
+   }
+   if (conn->mode == CONN_NEW) {
+       if (conn->in.len == 0) {
+           conn->closing = conn->eof;
+           return;
+       }
+       if ((uint8_t)conn->in.data[0] == FW_PROTO_MAGIC) {
+           conn->mode = CONN_BINARY;
+       } else if (conn->in.data[0] == '\n') {
+           // The stream opener; stream mode skips it as an empty line
+           conn->mode = CONN_STREAM;
+       } else {
+           conn->mode = memchr(conn->in.data, '\n', conn->in.len) ? CONN_STREAM : CONN_ONESHOT;
+       }
+   }
+
+   if (conn->mode == CONN_BINARY) {
+       process_frames(conn);
+       return;
+   }
+
+   if (conn->mode == CONN_ONESHOT) {
+       // Like the original single read: the command is whatever arrived
+       size_t len = conn->in.len < MAX_FW_CMD - 1 ? conn->in.len : MAX_FW_CMD - 1;
+       run_command(conn, conn->in.data, len);
+       conn->in.len = 0;
+       conn->closing = true;
+       return;
+   }
+
+   size_t start = 0;
+   while (start < conn->in.len) {
+       if (conn->out.len >= CONN_OUT_HIGH_WATER) {
+           conn->paused = true;
+           break;
+       }
+       char* line = conn->in.data + start;
+       char* nl = memchr(line, '\n', conn->in.len - start);
+       if (nl == NULL) {
+           break;
+       }
+       size_t len = nl - line;
+       start += len + 1;
+       if (len > 0 && line[len - 1] == '\r') {
+           len--;
+       }
+       // Blank lines are ignored so they cannot be mistaken for a terminator
+       if (len > 0) {
+           run_command(conn, line, len);
+       }
+   }
+   buf_consume(&conn->in, start);
+
+   if (conn->paused) {
+       return;
+   }
+   if (conn->eof) {
+       if (conn->in.len > 0) {
+           run_command(conn, conn->in.data, conn->in.len);
+           conn->in.len = 0;
+       }
+       conn->closing = true;
+   } else if (conn->in.len > MAX_PENDING_INPUT) {
+       conn->closing = true;
+   }
+}
@@ -0,0 +1,60 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fw_buf.h"
+
+
+// Output a connection may have waiting before its commands are paused
+#define CONN_OUT_HIGH_WATER (256 * 1024)
+
+
+typedef enum ConnMode
+{
+   CONN_NEW,       // nothing received yet
+   CONN_ONESHOT,   // legacy client: one command without a newline, then close
+   CONN_STREAM,    // newline-delimited commands until the client closes
+   CONN_BINARY     // check frames, see fw_proto.h
+} ConnMode;
+
+
+// Per-connection protocol state, shared by every server engine.
+//
+// A client that opens with an empty line is a stream client: each line is
+// one command and each response is written back in order, followed by an
+// empty line. A client whose first byte is FW_PROTO_MAGIC sends binary
+// check frames. Anything else is the legacy one-command exchange, whose
+// response is sent bare before the connection is closed. A legacy client
+// sends no newline and waits for the reply without closing, so a client
+// that skips the opener is taken for a stream client only if its first
+// read holds a whole line; stream clients should always send the opener.
+typedef struct FwConn
+{
+   FwBuf in;
+   FwBuf out;
+   ConnMode mode;
+   bool eof;       // the client has shut down its side
+   bool paused;    // commands are held back in in until out drains
+   bool closing;   // close once out has been flushed
+} FwConn;
+
+
+void conn_init(FwConn* conn);
+void conn_free(FwConn* conn);
+// Readies conn for a new client, keeping moderately sized buffers
+void conn_reset(FwConn* conn);
+
+// Runs every complete command in conn->in, appending the responses to
+// conn->out. Set eof once the client has shut down its side so a final
+// unterminated line is run too; it is remembered across calls.
+//
+// Once out holds CONN_OUT_HIGH_WATER bytes the remaining commands are left
+// in in and paused is set, so a client that does not read its responses
+// cannot grow out without bound. The engine then stops reading from the
+// client and calls conn_process again once out has been written.
+void conn_process(FwConn* conn, bool eof);
+
+
+#endif
@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+
+
+// Reader slots per block. A thread takes a slot on its first
+// epoch_enter() and gives it back when it exits; when every slot is taken
+// a new block is linked on, so readers never wait for one. Blocks are
+// never freed, as a reclaim may be walking them.
+#define EPOCH_SLOTS 4096
+
+
+typedef struct EpochSlot
+{
+   _Atomic uint64_t epoch;   // epoch announced on entry, 0 while outside
+   atomic_bool used;
+   char pad[64 - sizeof(uint64_t) - sizeof(atomic_bool)];
+} EpochSlot;
+
+
+struct Retired
+{
+   void* obj;
+   void (*free_fn)(void*);
+   uint64_t epoch;           // first epoch in which obj is unreachable
+   struct Retired* next;
+};
+
+
+typedef struct SlotBlock
+{
+   EpochSlot slots[EPOCH_SLOTS];
+   atomic_int inUse;                    // high-water mark of slot indexes
+   _Atomic(struct SlotBlock*) next;
+} __attribute__((aligned(64))) SlotBlock;
+
+
+static SlotBlock firstBlock;
+static _Atomic uint64_t globalEpoch = 1;
+static pthread_key_t slotKey;
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+static __thread EpochSlot* mySlot = NULL;
+static Retired* retiredHead = NULL;   // only touched by the serialized writer
+
+
+static void release_slot(void* arg)
+{
+   EpochSlot* slot = arg;
+   atomic_store(&slot->epoch, 0);
+   atomic_store(&slot->used, false);
+}
+
+
+static void make_slot_key(void)
+{
+   pthread_key_create(&slotKey, release_slot);
+}
+
+
+static EpochSlot* my_slot(void)
+{
+   if (mySlot != NULL) {
+       return mySlot;
+   }
+   pthread_once(&slotKeyOnce, make_slot_key);
+   SlotBlock* block = &firstBlock;
+   while (true) {
+       for (int i = 0; i < EPOCH_SLOTS; i++) {
+           EpochSlot* slot = &block->slots[i];
+           bool expected = false;
+           if (!atomic_load_explicit(&slot->used, memory_order_relaxed) &&
+               atomic_compare_exchange_strong(&slot->used, &expected, true)) {
+               int high = atomic_load(&block->inUse);
+               while (high < i + 1 && !atomic_compare_exchange_weak(&block->inUse, &high, i + 1)) {
+               }
+               mySlot = slot;
+               pthread_setspecific(slotKey, mySlot);
+               return mySlot;
+           }
+       }
+       SlotBlock* next = atomic_load(&block->next);
+       if (next == NULL) {
+           SlotBlock* fresh = aligned_alloc(64, sizeof(SlotBlock));
+           if (fresh == NULL) {
+               printf("Memory allocation failed\n");
+               exit(1);
+           }
+           memset(fresh, 0, sizeof(SlotBlock));
+           // Another thread may have linked a block first; use that one
+           if (atomic_compare_exchange_strong(&block->next, &next, fresh)) {
+               next = fresh;
+           } else {
+               free(fresh);
+           }
+       }
+       block = next;
+   }
+}
+
+
+void epoch_enter(void)
+{
+   EpochSlot* slot = my_slot();
+   atomic_store(&slot->epoch, atomic_load(&globalEpoch));
+}
+
+
+void epoch_exit(void)
+{
+   atomic_store(&mySlot->epoch, 0);
+}
+
+
+void epoch_retire(void* obj, void (*free_fn)(void*))
+{
+   Retired* r = malloc(sizeof(Retired));
+   if (r == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   r->obj = obj;
+   r->free_fn = free_fn;
+   // Readers announcing the new epoch entered after obj was unlinked
+   r->epoch = atomic_fetch_add(&globalEpoch, 1) + 1;
+   r->next = retiredHead;
+   retiredHead = r;
+}
+
+
+Retired* epoch_collect(void)
+{
+   uint64_t oldest = UINT64_MAX;
+   for (SlotBlock* block = &firstBlock; block != NULL; block = atomic_load(&block->next)) {
+       int inUse = atomic_load(&block->inUse);
+       for (int i = 0; i < inUse; i++) {
+           uint64_t e = atomic_load(&block->slots[i].epoch);
+           if (e != 0 && e < oldest) {
+               oldest = e;
+           }
+       }
+   }
+
+   Retired* ready = NULL;
+   Retired** link = &retiredHead;
+   while (*link != NULL) {
+       Retired* r = *link;
+       if (r->epoch <= oldest) {
+           *link = r->next;
+           r->next = ready;
+           ready = r;
+       } else {
+           link = &r->next;
+       }
+   }
+   return ready;
+}
+
+
+void epoch_free(Retired* list)
+{
+   while (list != NULL) {
+       Retired* r = list;
+       list = r->next;
+       r->free_fn(r->obj);
+       free(r);
+   }
+}
+
+
+void epoch_reclaim(void)
+{
+   epoch_free(epoch_collect());
+}
@@ -0,0 +1,32 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+
+// Epoch-based reclamation for data read without locks.
+//
+// A reader brackets its accesses with epoch_enter()/epoch_exit(); neither
+// call ever blocks, however many reader threads there are. A writer that
+// unlinks an object hands it to epoch_retire() after publishing the
+// replacement, and the object is freed once every reader that could still
+// hold it has left its critical section. Writers must be serialized by the
+// caller.
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Frees obj with free_fn once no reader can reach it any more
+void epoch_retire(void* obj, void (*free_fn)(void*));
+
+// Frees whatever retired objects have become unreachable
+void epoch_reclaim(void);
+
+// epoch_reclaim() in two steps, so the freeing can happen after the
+// writer's lock is dropped: epoch_collect() detaches the unreachable
+// objects and must be serialized like epoch_retire(); epoch_free() frees
+// them and may run anywhere.
+typedef struct Retired Retired;
+Retired* epoch_collect(void);
+void epoch_free(Retired* list);
+
+
+#endif
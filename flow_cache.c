@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+
+#include "flow_cache.h"
+
+
+#define FLOW_CACHE_SLOTS 65536   // power of two
+#define COUNTER_STRIPES 16       // power of two
+
+
+// An odd seq means a writer is filling the slot
+typedef struct FlowSlot
+{
+   atomic_uint seq;
+   atomic_uint_least64_t key;
+   atomic_uint_least64_t generation;   // 0 for a never used slot
+   atomic_uint_least64_t pos;
+} FlowSlot;
+
+
+// Hit and miss counts are spread over cache lines by key, so threads
+// checking different flows do not share one counter
+typedef struct CounterStripe
+{
+   _Alignas(64) atomic_uint_least64_t hits;
+   atomic_uint_least64_t misses;
+} CounterStripe;
+
+
+static FlowSlot slots[FLOW_CACHE_SLOTS];
+static CounterStripe counters[COUNTER_STRIPES];
+
+
+static size_t hash_key(uint64_t key)
+{
+   // Fibonacci hashing, as in the query sets
+   return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+
+bool flow_cache_lookup(uint64_t key, uint64_t generation, size_t* pos)
+{
+   size_t h = hash_key(key);
+   FlowSlot* slot = &slots[h & (FLOW_CACHE_SLOTS - 1)];
+   CounterStripe* stripe = &counters[h & (COUNTER_STRIPES - 1)];
+
+   bool hit = false;
+   unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+   if ((seq & 1) == 0) {
+       uint64_t k = atomic_load_explicit(&slot->key, memory_order_relaxed);
+       uint64_t g = atomic_load_explicit(&slot->generation, memory_order_relaxed);
+       uint64_t p = atomic_load_explicit(&slot->pos, memory_order_relaxed);
+       atomic_thread_fence(memory_order_acquire);
+       // A changed seq means the fields may come from two different writes
+       if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq &&
+           k == key && g == generation) {
+           *pos = (size_t)p;
+           hit = true;
+       }
+   }
+   if (hit) {
+       atomic_fetch_add_explicit(&stripe->hits, 1, memory_order_relaxed);
+   } else {
+       *pos = 0;
+       atomic_fetch_add_explicit(&stripe->misses, 1, memory_order_relaxed);
+   }
+   return hit;
+}
+
+
+void flow_cache_store(uint64_t key, uint64_t generation, size_t pos)
+{
+   FlowSlot* slot = &slots[hash_key(key) & (FLOW_CACHE_SLOTS - 1)];
+   unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+   // Another writer has the slot; losing this entry only costs a rescan
+   if ((seq & 1) != 0 ||
+       !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+                                                memory_order_acquire, memory_order_relaxed)) {
+       return;
+   }
+   atomic_thread_fence(memory_order_release);
+   atomic_store_explicit(&slot->key, key, memory_order_relaxed);
+   atomic_store_explicit(&slot->generation, generation, memory_order_relaxed);
+   atomic_store_explicit(&slot->pos, pos, memory_order_relaxed);
+   atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+
+void flow_cache_get_counters(FlowCacheCounters* out)
+{
+   out->hits = 0;
+   out->misses = 0;
+   for (size_t i = 0; i < COUNTER_STRIPES; i++) {
+       out->hits += atomic_load_explicit(&counters[i].hits, memory_order_relaxed);
+       out->misses += atomic_load_explicit(&counters[i].misses, memory_order_relaxed);
+   }
+}
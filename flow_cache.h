@@ -0,0 +1,40 @@
+#ifndef FLOW_CACHE_H
+#define FLOW_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Fixed-size cache of recent checks, keyed on the packed (ip, port) value.
+//
+// A check records the query under the first matching rule that does not
+// have it yet, so its verdict depends on what earlier checks recorded. The
+// cache therefore keeps where the last check of a flow stopped: every
+// matching rule before that position already holds the query, and the
+// next check resumes the scan there. A position at the end of the table
+// is a cached reject that needs no scan at all.
+//
+// Entries carry the rule set generation they were computed against and
+// are ignored once A or D has published a newer one, so invalidation is
+// free. Slots are direct-mapped and guarded by per-slot sequence counters;
+// readers never wait and a writer that finds its slot busy skips caching.
+
+typedef struct FlowCacheCounters
+{
+   uint64_t hits;
+   uint64_t misses;
+} FlowCacheCounters;
+
+
+// Sets *pos to where the scan for key should resume and returns true if
+// there is an entry for generation; otherwise sets *pos to 0
+bool flow_cache_lookup(uint64_t key, uint64_t generation, size_t* pos);
+
+// Records that the scan for key in generation stopped before pos
+void flow_cache_store(uint64_t key, uint64_t generation, size_t pos);
+
+void flow_cache_get_counters(FlowCacheCounters* counters);
+
+
+#endif
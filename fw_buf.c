@@ -0,0 +1,82 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fw_buf.h"
+
+
+void buf_init(FwBuf* buf)
+{
+   buf->data = NULL;
+   buf->len = 0;
+   buf->cap = 0;
+}
+
+
+void buf_free(FwBuf* buf)
+{
+   free(buf->data);
+   buf_init(buf);
+}
+
+
+char* buf_reserve(FwBuf* buf, size_t extra)
+{
+   if (buf->len + extra > buf->cap) {
+       size_t cap = buf->cap ? buf->cap : 256;
+       while (cap < buf->len + extra) {
+           cap *= 2;
+       }
+       char* data = realloc(buf->data, cap);
+       if (data == NULL) {
+           printf("Memory allocation failed\n");
+           exit(1);
+       }
+       buf->data = data;
+       buf->cap = cap;
+   }
+   return buf->data + buf->len;
+}
+
+
+void buf_append(FwBuf* buf, const void* data, size_t len)
+{
+   memcpy(buf_reserve(buf, len), data, len);
+   buf->len += len;
+}
+
+
+void buf_puts(FwBuf* buf, const char* str)
+{
+   buf_append(buf, str, strlen(str));
+}
+
+
+void buf_printf(FwBuf* buf, const char* fmt, ...)
+{
+   va_list args;
+   va_start(args, fmt);
+   // Try the space already there first; most lines fit
+   char* dst = buf_reserve(buf, 64);
+   size_t room = buf->cap - buf->len;
+   int n = vsnprintf(dst, room, fmt, args);
+   va_end(args);
+   if (n < 0) {
+       return;
+   }
+   if ((size_t)n >= room) {
+       buf_reserve(buf, n + 1);
+       va_start(args, fmt);
+       vsnprintf(buf->data + buf->len, n + 1, fmt, args);
+       va_end(args);
+   }
+   buf->len += n;
+}
+
+
+void buf_consume(FwBuf* buf, size_t n)
+{
+   memmove(buf->data, buf->data + n, buf->len - n);
+   buf->len -= n;
+}
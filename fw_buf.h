@@ -0,0 +1,30 @@
+#ifndef FW_BUF_H
+#define FW_BUF_H
+
+#include <stddef.h>
+
+
+// Growable byte buffer; data is not NUL-terminated
+typedef struct FwBuf
+{
+   char* data;
+   size_t len;
+   size_t cap;
+} FwBuf;
+
+
+void buf_init(FwBuf* buf);
+void buf_free(FwBuf* buf);
+// Makes room for at least `extra` more bytes and returns the write position
+char* buf_reserve(FwBuf* buf, size_t extra);
+void buf_append(FwBuf* buf, const void* data, size_t len);
+// Appends a NUL-terminated string, without the NUL
+void buf_puts(FwBuf* buf, const char* str);
+// Appends printf-style formatted text
+void buf_printf(FwBuf* buf, const char* fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+// Drops the first n bytes
+void buf_consume(FwBuf* buf, size_t n);
+
+
+#endif
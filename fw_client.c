@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h> // for getaddrinfo
+
+#include "fw_client.h"
+
+
+int connect_to_server(const char* serverHost, int serverPort)
+{
+   // Resolve the server; an IPv6 address or name works as well as IPv4
+   struct addrinfo hints, *addrs;
+   char port[16];
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(port, sizeof(port), "%d", serverPort);
+   if (getaddrinfo(serverHost, port, &hints, &addrs) != 0) {
+       fprintf(stderr,"ERROR, no such host\n");
+       exit(0);
+   }
+
+
+   // Connect to the first address that takes the connection
+   int sockfd = -1;
+   for (struct addrinfo* a = addrs; a != NULL && sockfd < 0; a = a->ai_next) {
+       sockfd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+       if (sockfd < 0) {
+           continue;
+       }
+       if (connect(sockfd, a->ai_addr, a->ai_addrlen) < 0) {
+           close(sockfd);
+           sockfd = -1;
+       }
+   }
+   freeaddrinfo(addrs);
+   if (sockfd < 0) {
+       perror("ERROR connecting");
+       exit(1);
+   }
+   return sockfd;
+}
+
+
+void write_fully(int sockfd, const void* data, size_t len)
+{
+   const char* p = data;
+   while (len > 0) {
+       ssize_t w = write(sockfd, p, len);
+       if (w < 0) {
+           perror("ERROR writing to socket");
+           exit(1);
+       }
+       p += w;
+       len -= w;
+   }
+}
+
+
+void read_fully(int sockfd, void* data, size_t len)
+{
+   char* p = data;
+   while (len > 0) {
+       ssize_t n = read(sockfd, p, len);
+       if (n < 0) {
+           perror("ERROR reading from socket");
+           exit(1);
+       }
+       if (n == 0) {
+           fprintf(stderr, "ERROR, server closed the connection\n");
+           exit(1);
+       }
+       p += n;
+       len -= n;
+   }
+}
@@ -0,0 +1,20 @@
+#ifndef FW_CLIENT_H
+#define FW_CLIENT_H
+
+#include <stddef.h>
+
+
+// Socket helpers shared by the client and the load generator. Each one
+// reports the failure and exits rather than returning an error.
+
+// Connects to the server
+int connect_to_server(const char* serverHost, int serverPort);
+
+// Writes all len bytes
+void write_fully(int sockfd, const void* data, size_t len);
+
+// Reads exactly len bytes
+void read_fully(int sockfd, void* data, size_t len);
+
+
+#endif
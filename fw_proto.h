@@ -0,0 +1,73 @@
+#ifndef FW_PROTO_H
+#define FW_PROTO_H
+
+#include <stdint.h>
+
+
+// Binary check protocol, shared by the client and the server.
+//
+// A connection whose first byte is FW_PROTO_MAGIC speaks frames instead of
+// text. Every field is big-endian and fixed width:
+//
+//   request   magic u8 | FW_FRAME_CHECK u8 | reserved u16 | count u32
+//             then count entries of ip u32 | port u16
+//   reply     magic u8 | FW_FRAME_VERDICT u8 | status u16 | count u32
+//             then (count + 7) / 8 bytes, bit i (LSB first) set if
+//             check i was accepted
+//
+// Each check behaves like a C command. A frame with a bad header is
+// answered with a non-zero status and no bitmap, then the connection is
+// closed.
+
+// No text command starts with this byte
+#define FW_PROTO_MAGIC 0xFB
+
+#define FW_FRAME_CHECK   0x01
+#define FW_FRAME_VERDICT 0x81
+
+#define FW_STATUS_OK        0
+#define FW_STATUS_BAD_FRAME 1
+#define FW_STATUS_TOO_LARGE 2
+
+#define FW_FRAME_HEADER 8
+#define FW_CHECK_ENTRY  6
+// Largest count a check frame may carry
+#define FW_MAX_CHECKS   65536
+
+
+static inline uint16_t proto_get16(const uint8_t* p)
+{
+   return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t proto_get32(const uint8_t* p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+          ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void proto_put16(uint8_t* p, uint16_t v)
+{
+   p[0] = (uint8_t)(v >> 8);
+   p[1] = (uint8_t)v;
+}
+
+static inline void proto_put32(uint8_t* p, uint32_t v)
+{
+   p[0] = (uint8_t)(v >> 24);
+   p[1] = (uint8_t)(v >> 16);
+   p[2] = (uint8_t)(v >> 8);
+   p[3] = (uint8_t)v;
+}
+
+// Writes a frame header into p
+static inline void proto_put_header(uint8_t* p, uint8_t type, uint16_t status, uint32_t count)
+{
+   p[0] = FW_PROTO_MAGIC;
+   p[1] = type;
+   proto_put16(p + 2, status);
+   proto_put32(p + 4, count);
+}
+
+
+#endif
@@ -0,0 +1,587 @@
+// Load generator for the firewall server.
+//
+// Usage: loadgen [-t threads] [-c connections] [-d seconds] [-r rate]
+//                [-m A:D:C:L:R] [-a addresses] [-p ports] [-z skew]
+//                <serverHost> <serverPort>
+//
+// Each thread drives its share of the connections in stream mode. Without
+// -r the run is closed-loop: every connection keeps one request in flight
+// and sends the next as soon as the answer arrives. With -r it is
+// open-loop: requests fall due at a constant total rate whatever the
+// server does, and latency is measured from when a request was due, so a
+// stalled server shows up in the tail instead of slowing the load down.
+//
+// -m weighs the commands sent. C and A draw addresses from 10.0.0.0
+// upwards, uniformly or, with -z, Zipf-distributed with that exponent so
+// that a few flows dominate as in production traffic. D removes a rule
+// the same thread added earlier and the server has confirmed, so every
+// D should find its rule.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fw_buf.h"
+#include "fw_client.h"
+#include "stats.h"
+
+
+#define MAX_PIPELINE 1024     // requests in flight on one connection
+#define MAX_ADDED 4096        // confirmed rules a thread keeps for D
+#define DRAIN_SECONDS 5       // wait for answers after the run
+
+
+typedef enum LoadKind { KIND_A, KIND_D, KIND_C, KIND_L, KIND_R, KINDS } LoadKind;
+
+static const char kindNames[KINDS] = { 'A', 'D', 'C', 'L', 'R' };
+
+
+typedef struct LoadConfig
+{
+   int threads;
+   int connections;
+   int seconds;
+   double rate;               // requests per second; 0 for closed-loop
+   int weights[KINDS];
+   int addresses;
+   int ports;
+   double skew;               // Zipf exponent; 0 for uniform
+   const double* zipfCdf;     // addresses entries when skew > 0
+} LoadConfig;
+
+
+// An A rule: addresses lo to hi, ports port to port + 15
+typedef struct LoadRule
+{
+   uint32_t lo;
+   uint32_t hi;
+   int port;
+} LoadRule;
+
+
+// One request sent and not yet answered
+typedef struct InFlight
+{
+   uint64_t due;
+   LoadKind kind;
+   LoadRule rule;     // the rule of an A or D
+} InFlight;
+
+
+typedef struct LoadConn
+{
+   int fd;
+   FwBuf in;
+   size_t inScanned;   // no response ends before this offset of in
+   FwBuf out;
+   InFlight ring[MAX_PIPELINE];
+   size_t head;
+   size_t count;
+} LoadConn;
+
+
+typedef struct LoadThread
+{
+   const LoadConfig* config;
+   LoadConn* conns;
+   int nconns;
+   uint64_t rng;
+   uint64_t start;
+   uint64_t end;
+   uint64_t hist[KINDS][STATS_BUCKETS];
+   uint64_t completed[KINDS];
+   uint64_t max;
+   uint64_t errors;
+   uint64_t dropped;          // open-loop requests with no room to send
+   uint64_t timedOut;
+   LoadRule added[MAX_ADDED];   // stack of rules the server confirmed
+   size_t addedCount;
+} LoadThread;
+
+
+static void usage(const char* prog)
+{
+   fprintf(stderr, "Usage: %s [-t threads] [-c connections] [-d seconds] [-r rate]\n"
+                   "       [-m A:D:C:L:R] [-a addresses] [-p ports] [-z skew]\n"
+                   "       <serverHost> <serverPort>\n", prog);
+   exit(1);
+}
+
+
+// xorshift64*
+static uint64_t next_random(uint64_t* state)
+{
+   *state ^= *state >> 12;
+   *state ^= *state << 25;
+   *state ^= *state >> 27;
+   return *state * 2685821657736338717ull;
+}
+
+
+static double next_unit(uint64_t* state)
+{
+   return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+
+// Cumulative Zipf probabilities over n ranks with exponent s
+static double* build_zipf(int n, double s)
+{
+   double* cdf = malloc(n * sizeof(double));
+   if (cdf == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   double sum = 0;
+   for (int i = 0; i < n; i++) {
+       sum += 1.0 / pow(i + 1, s);
+       cdf[i] = sum;
+   }
+   for (int i = 0; i < n; i++) {
+       cdf[i] /= sum;
+   }
+   return cdf;
+}
+
+
+static uint32_t pick_address(LoadThread* t)
+{
+   const LoadConfig* config = t->config;
+   uint64_t rank;
+   if (config->skew > 0) {
+       double u = next_unit(&t->rng);
+       size_t lo = 0, hi = config->addresses - 1;
+       while (lo < hi) {
+           size_t mid = (lo + hi) / 2;
+           if (config->zipfCdf[mid] < u) {
+               lo = mid + 1;
+           } else {
+               hi = mid;
+           }
+       }
+       rank = lo;
+   } else {
+       rank = next_random(&t->rng) % config->addresses;
+   }
+   // Scatter the popular ranks over the address space
+   return (10u << 24) + (uint32_t)(rank * 2654435761ull % config->addresses);
+}
+
+
+static void format_ip(char* out, uint32_t ip)
+{
+   sprintf(out, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+}
+
+
+static LoadKind pick_kind(LoadThread* t)
+{
+   const int* weights = t->config->weights;
+   int total = 0;
+   for (int k = 0; k < KINDS; k++) {
+       total += weights[k];
+   }
+   int r = (int)(next_random(&t->rng) % total);
+   for (int k = 0; k < KINDS; k++) {
+       if (r < weights[k]) {
+           return k;
+       }
+       r -= weights[k];
+   }
+   return KIND_C;
+}
+
+
+// Queues one request on conn, due at the given time
+static void send_request(LoadThread* t, LoadConn* conn, uint64_t due)
+{
+   LoadKind kind = pick_kind(t);
+   if (kind == KIND_D && t->addedCount == 0) {
+       kind = KIND_C;
+   }
+   char lo[16], hi[16];
+   LoadRule rule = { 0, 0, 0 };
+   switch (kind) {
+   case KIND_A:
+   case KIND_D:
+       if (kind == KIND_A) {
+           rule.lo = pick_address(t);
+           rule.hi = rule.lo + (uint32_t)(next_random(&t->rng) % 256);
+           rule.port = (int)(next_random(&t->rng) % t->config->ports);
+       } else {
+           // The newest confirmed rule comes off the stack, so no two D
+           // commands name the same one
+           rule = t->added[--t->addedCount];
+       }
+       format_ip(lo, rule.lo);
+       format_ip(hi, rule.hi);
+       buf_printf(&conn->out, "%c %s-%s %d-%d\n", kind == KIND_A ? 'A' : 'D',
+                  lo, hi, rule.port, rule.port + 15);
+       break;
+   case KIND_C:
+       format_ip(lo, pick_address(t));
+       buf_printf(&conn->out, "C %s %d\n", lo, (int)(next_random(&t->rng) % t->config->ports));
+       break;
+   case KIND_L:
+       buf_puts(&conn->out, "L\n");
+       break;
+   default:
+       buf_puts(&conn->out, "R\n");
+       break;
+   }
+   InFlight* slot = &conn->ring[(conn->head + conn->count) % MAX_PIPELINE];
+   slot->due = due;
+   slot->kind = kind;
+   slot->rule = rule;
+   conn->count++;
+}
+
+
+// Matches every complete response in conn->in to its request. The server
+// ends each response with an empty line.
+static void take_responses(LoadThread* t, LoadConn* conn, uint64_t now)
+{
+   char* data = conn->in.data;
+   size_t start = 0;
+   size_t i = conn->inScanned > 1 ? conn->inScanned : 1;
+   for (; i < conn->in.len; i++) {
+       if (data[i] != '\n' || data[i - 1] != '\n') {
+           continue;
+       }
+       if (conn->count == 0) {
+           t->errors++;
+       } else {
+           InFlight* req = &conn->ring[conn->head];
+           conn->head = (conn->head + 1) % MAX_PIPELINE;
+           conn->count--;
+           uint64_t latency = now > req->due ? now - req->due : 0;
+           t->hist[req->kind][stats_bucket(latency)]++;
+           t->completed[req->kind]++;
+           if (latency > t->max) {
+               t->max = latency;
+           }
+           const char* text = data + start;
+           if (strncmp(text, "Illegal", 7) == 0 || strncmp(text, "Invalid", 7) == 0 ||
+               strncmp(text, "Rule invalid", 12) == 0 || strncmp(text, "Rule not found", 14) == 0) {
+               t->errors++;
+           }
+           // A rule only becomes a D target once the server has it; a
+           // full stack leaves the rule in place for good
+           if (req->kind == KIND_A && strncmp(text, "Rule added", 10) == 0 &&
+               t->addedCount < MAX_ADDED) {
+               t->added[t->addedCount++] = req->rule;
+           }
+       }
+       start = i + 1;
+       i++;
+   }
+   conn->inScanned = i > start ? i - start : 0;
+   buf_consume(&conn->in, start);
+}
+
+
+// Returns false if the connection failed
+static bool service(LoadThread* t, LoadConn* conn, short revents, uint64_t now)
+{
+   if (revents & (POLLIN | POLLHUP | POLLERR)) {
+       char* dst = buf_reserve(&conn->in, 65536);
+       ssize_t n = read(conn->fd, dst, 65536);
+       if (n == 0 || (n < 0 && errno != EAGAIN)) {
+           return false;
+       }
+       if (n > 0) {
+           conn->in.len += n;
+           take_responses(t, conn, now);
+       }
+   }
+   if (conn->out.len > 0) {
+       ssize_t n = write(conn->fd, conn->out.data, conn->out.len);
+       if (n < 0) {
+           return errno == EAGAIN;
+       }
+       buf_consume(&conn->out, n);
+   }
+   return true;
+}
+
+
+static void* load_thread(void* arg)
+{
+   LoadThread* t = arg;
+   const LoadConfig* config = t->config;
+   struct pollfd* fds = calloc(t->nconns, sizeof(struct pollfd));
+   if (fds == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   uint64_t deadline = t->start + (uint64_t)config->seconds * 1000000000ull;
+   uint64_t giveUp = deadline + DRAIN_SECONDS * 1000000000ull;
+   double interval = config->rate > 0 ? 1e9 * config->threads / config->rate : 0;
+   double nextDue = t->start;
+   size_t nextConn = 0;
+
+   while (true) {
+       uint64_t now = stats_now();
+       size_t pending = 0;
+       for (int i = 0; i < t->nconns; i++) {
+           pending += t->conns[i].count;
+       }
+       if (now >= giveUp || (now >= deadline && pending == 0)) {
+           t->timedOut = pending;
+           break;
+       }
+
+       if (now < deadline) {
+           if (interval == 0) {
+               for (int i = 0; i < t->nconns; i++) {
+                   if (t->conns[i].count == 0) {
+                       send_request(t, &t->conns[i], now);
+                   }
+               }
+           } else {
+               for (; nextDue <= now && nextDue < deadline; nextDue += interval) {
+                   LoadConn* conn = &t->conns[nextConn++ % t->nconns];
+                   if (conn->count == MAX_PIPELINE) {
+                       t->dropped++;
+                   } else {
+                       send_request(t, conn, (uint64_t)nextDue);
+                   }
+               }
+           }
+       }
+
+       int timeout = 100;
+       if (interval > 0 && now < deadline) {
+           timeout = nextDue > now ? (int)((nextDue - now) / 1000000) : 0;
+       }
+       for (int i = 0; i < t->nconns; i++) {
+           fds[i].fd = t->conns[i].fd;
+           fds[i].events = POLLIN | (t->conns[i].out.len > 0 ? POLLOUT : 0);
+       }
+       if (poll(fds, t->nconns, timeout) < 0 && errno != EINTR) {
+           perror("ERROR polling");
+           exit(1);
+       }
+       now = stats_now();
+       for (int i = 0; i < t->nconns; i++) {
+           if (!service(t, &t->conns[i], fds[i].revents, now)) {
+               fprintf(stderr, "ERROR, server closed a connection\n");
+               exit(1);
+           }
+       }
+   }
+   t->end = stats_now();
+   free(fds);
+   return NULL;
+}
+
+
+// Upper bound of the bucket holding the given fraction of the values
+static double percentile_us(const uint64_t* hist, uint64_t count, double fraction)
+{
+   uint64_t rank = (uint64_t)(count * fraction);
+   uint64_t seen = 0;
+   for (int b = 0; b + 1 < STATS_BUCKETS; b++) {
+       seen += hist[b];
+       if (seen > rank) {
+           return (stats_bucket_low(b + 1) - 1) / 1000.0;
+       }
+   }
+   return 0;
+}
+
+
+static void print_latency(const char* name, const uint64_t* hist, uint64_t count)
+{
+   printf("%s: %llu requests, p50 %.1f us, p99 %.1f us, p99.9 %.1f us\n",
+          name, (unsigned long long)count, percentile_us(hist, count, 0.5),
+          percentile_us(hist, count, 0.99), percentile_us(hist, count, 0.999));
+}
+
+
+static bool parse_int(const char* text, int* value, int min)
+{
+   char* end;
+   long v = strtol(text, &end, 10);
+   *value = (int)v;
+   return *end == '\0' && end != text && v >= min && v <= 1 << 24;
+}
+
+
+static bool parse_mix(const char* text, int* weights)
+{
+   int total = 0;
+   for (int k = 0; k < KINDS; k++) {
+       char* end;
+       long w = strtol(text, &end, 10);
+       if (end == text || w < 0 || w > 1000000 || *end != (k + 1 < KINDS ? ':' : '\0')) {
+           return false;
+       }
+       weights[k] = (int)w;
+       total += w;
+       text = end + 1;
+   }
+   return total > 0;
+}
+
+
+int main(int argc, char** argv)
+{
+   LoadConfig config = {
+       .threads = 4, .connections = 0, .seconds = 10, .rate = 0,
+       .weights = { 2, 1, 95, 0, 2 }, .addresses = 65536, .ports = 1024, .skew = 0
+   };
+   int opt;
+   while ((opt = getopt(argc, argv, "t:c:d:r:m:a:p:z:")) != -1) {
+       char* end;
+       switch (opt) {
+       case 't':
+           if (!parse_int(optarg, &config.threads, 1)) {
+               usage(argv[0]);
+           }
+           break;
+       case 'c':
+           if (!parse_int(optarg, &config.connections, 1)) {
+               usage(argv[0]);
+           }
+           break;
+       case 'd':
+           if (!parse_int(optarg, &config.seconds, 1)) {
+               usage(argv[0]);
+           }
+           break;
+       case 'r':
+           config.rate = strtod(optarg, &end);
+           if (*end != '\0' || config.rate < 0) {
+               usage(argv[0]);
+           }
+           break;
+       case 'm':
+           if (!parse_mix(optarg, config.weights)) {
+               usage(argv[0]);
+           }
+           break;
+       case 'a':
+           if (!parse_int(optarg, &config.addresses, 1)) {
+               usage(argv[0]);
+           }
+           break;
+       case 'p':
+           if (!parse_int(optarg, &config.ports, 1) || config.ports > 65536 - 15) {
+               usage(argv[0]);
+           }
+           break;
+       case 'z':
+           config.skew = strtod(optarg, &end);
+           if (*end != '\0' || config.skew < 0) {
+               usage(argv[0]);
+           }
+           break;
+       default:
+           usage(argv[0]);
+       }
+   }
+   if (argc - optind != 2) {
+       usage(argv[0]);
+   }
+   const char* serverHost = argv[optind];
+   int serverPort = atoi(argv[optind + 1]);
+   if (config.connections < config.threads) {
+       config.connections = config.threads;
+   }
+   double* zipf = NULL;
+   if (config.skew > 0) {
+       zipf = build_zipf(config.addresses, config.skew);
+       config.zipfCdf = zipf;
+   }
+
+   LoadConn* conns = calloc(config.connections, sizeof(LoadConn));
+   LoadThread* threads = calloc(config.threads, sizeof(LoadThread));
+   pthread_t* tids = calloc(config.threads, sizeof(pthread_t));
+   if (conns == NULL || threads == NULL || tids == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (int i = 0; i < config.connections; i++) {
+       conns[i].fd = connect_to_server(serverHost, serverPort);
+       fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL, 0) | O_NONBLOCK);
+       buf_init(&conns[i].in);
+       buf_init(&conns[i].out);
+       // The empty line that opens a stream connection
+       buf_append(&conns[i].out, "\n", 1);
+   }
+
+   uint64_t start = stats_now();
+   int first = 0;
+   for (int i = 0; i < config.threads; i++) {
+       LoadThread* t = &threads[i];
+       t->config = &config;
+       t->conns = conns + first;
+       t->nconns = config.connections / config.threads + (i < config.connections % config.threads);
+       first += t->nconns;
+       t->rng = 0x9E3779B97F4A7C15ull * (i + 1);
+       t->start = start;
+       if (pthread_create(&tids[i], NULL, load_thread, t) != 0) {
+           perror("Failed to create thread");
+           exit(1);
+       }
+   }
+
+   static uint64_t total[KINDS + 1][STATS_BUCKETS];
+   uint64_t completed[KINDS + 1] = { 0 };
+   uint64_t errors = 0, dropped = 0, timedOut = 0, max = 0, end = start;
+   for (int i = 0; i < config.threads; i++) {
+       LoadThread* t = &threads[i];
+       pthread_join(tids[i], NULL);
+       for (int k = 0; k < KINDS; k++) {
+           for (int b = 0; b < STATS_BUCKETS; b++) {
+               total[k][b] += t->hist[k][b];
+               total[KINDS][b] += t->hist[k][b];
+           }
+           completed[k] += t->completed[k];
+           completed[KINDS] += t->completed[k];
+       }
+       errors += t->errors;
+       dropped += t->dropped;
+       timedOut += t->timedOut;
+       max = t->max > max ? t->max : max;
+       end = t->end > end ? t->end : end;
+   }
+
+   double elapsed = (end - start) / 1e9;
+   if (config.rate > 0) {
+       printf("open loop at %.0f requests/s", config.rate);
+   } else {
+       printf("closed loop");
+   }
+   printf(", %d threads, %d connections, %.1f s\n", config.threads, config.connections, elapsed);
+   printf("throughput: %.0f requests/s, %llu errors, %llu dropped, %llu unanswered\n",
+          completed[KINDS] / elapsed, (unsigned long long)errors,
+          (unsigned long long)dropped, (unsigned long long)timedOut);
+   print_latency("all", total[KINDS], completed[KINDS]);
+   printf("max: %.1f us\n", max / 1000.0);
+   for (int k = 0; k < KINDS; k++) {
+       if (completed[k] > 0) {
+           char name[2] = { kindNames[k], '\0' };
+           print_latency(name, total[k], completed[k]);
+       }
+   }
+
+   for (int i = 0; i < config.connections; i++) {
+       close(conns[i].fd);
+       buf_free(&conns[i].in);
+       buf_free(&conns[i].out);
+   }
+   free(conns);
+   free(threads);
+   free(tids);
+   free(zipf);
+   return 0;
+}
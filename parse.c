@@ -0,0 +1,278 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "parse.h"
+
+
+// Large enough that anything at or above it is out of range, small enough
+// that accumulating one more digit cannot overflow
+#define SATURATE 1000000
+
+
+static bool is_space(char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+
+static bool is_digit(char c)
+{
+   return c >= '0' && c <= '9';
+}
+
+
+static bool fail(FwParseError* err, const char* text, const char* at, const char* what)
+{
+   err->pos = at - text;
+   err->what = what;
+   return false;
+}
+
+
+// Finds the next space-separated field at or after p; false if none
+static bool next_field(const char** p, const char** end)
+{
+   const char* s = *p;
+   while (*s == ' ') {
+       s++;
+   }
+   if (*s == '\0') {
+       *p = s;
+       return false;
+   }
+   const char* e = s;
+   while (*e != ' ' && *e != '\0') {
+       e++;
+   }
+   *p = s;
+   *end = e;
+   return true;
+}
+
+
+// Reads a number the way "%d" does; returns the position after its
+// digits, or NULL if there are none
+static const char* scan_int(const char* p, const char* end, long* value)
+{
+   while (p < end && is_space(*p)) {
+       p++;
+   }
+   bool negative = false;
+   if (p < end && (*p == '+' || *p == '-')) {
+       negative = *p == '-';
+       p++;
+   }
+   if (p == end || !is_digit(*p)) {
+       return NULL;
+   }
+   long v = 0;
+   while (p < end && is_digit(*p)) {
+       if (v < SATURATE) {
+           v = v * 10 + (*p - '0');
+       }
+       p++;
+   }
+   *value = negative ? -v : v;
+   return p;
+}
+
+
+// Parses a dotted quad from [p, end); anything after the last octet is
+// ignored
+static bool parse_ip(const char* text, const char* p, const char* end,
+                     uint8_t ip[4], FwParseError* err)
+{
+   for (int i = 0; i < 4; i++) {
+       long v;
+       const char* q = scan_int(p, end, &v);
+       if (q == NULL) {
+           return fail(err, text, p, "expected an address octet");
+       }
+       if (v < 0 || v > 255) {
+           return fail(err, text, p, "address octet out of range 0-255");
+       }
+       ip[i] = (uint8_t)v;
+       if (i < 3) {
+           if (q == end || *q != '.') {
+               return fail(err, text, q, "expected '.'");
+           }
+           q++;
+       }
+       p = q;
+   }
+   return true;
+}
+
+
+// Parses a port that must fill [p, end) exactly. Like strtol(), an empty
+// field reads as 0.
+static bool parse_port(const char* text, const char* p, const char* end,
+                       int* port, FwParseError* err)
+{
+   if (p == end) {
+       *port = 0;
+       return true;
+   }
+   long v;
+   const char* q = scan_int(p, end, &v);
+   if (q == NULL || q != end) {
+       return fail(err, text, q != NULL ? q : p, "invalid port number");
+   }
+   if (v < 0 || v > 65535) {
+       return fail(err, text, p, "port out of range 0-65535");
+   }
+   *port = (int)v;
+   return true;
+}
+
+
+// Parses an IPv6 address that must fill [p, end) exactly, in any form
+// inet_pton() takes
+static bool parse_ip6(const char* text, const char* p, const char* end,
+                      uint8_t ip[16], FwParseError* err)
+{
+   char address[INET6_ADDRSTRLEN];
+   if ((size_t)(end - p) >= sizeof(address)) {
+       return fail(err, text, p, "invalid IPv6 address");
+   }
+   memcpy(address, p, end - p);
+   address[end - p] = '\0';
+   if (inet_pton(AF_INET6, address, ip) != 1) {
+       return fail(err, text, p, "invalid IPv6 address");
+   }
+   return true;
+}
+
+
+// True for an IPv4-mapped address, ::ffff:a.b.c.d
+static bool is_v4_mapped(const uint8_t ip[16])
+{
+   static const uint8_t prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+   return memcmp(ip, prefix, sizeof(prefix)) == 0;
+}
+
+
+static bool parse_address(const char* text, const char* p, const char* end,
+                          bool ipv6, uint8_t* ip, FwParseError* err)
+{
+   return ipv6 ? parse_ip6(text, p, end, ip, err) : parse_ip(text, p, end, ip, err);
+}
+
+
+// Parses "<ip>/<length>" into the first and last address of the prefix,
+// each size bytes long; host bits set in ip are ignored
+static bool parse_prefix(const char* text, const char* p, const char* slash, const char* end,
+                         bool ipv6, uint8_t* lo, uint8_t* hi, FwParseError* err)
+{
+   size_t size = ipv6 ? 16 : 4;
+   if (!parse_address(text, p, slash, ipv6, lo, err)) {
+       return false;
+   }
+   const char* q = slash + 1;
+   long length = 0;
+   if (q == end) {
+       return fail(err, text, q, "missing prefix length");
+   }
+   while (q < end && is_digit(*q) && length <= (long)(8 * size)) {
+       length = length * 10 + (*q++ - '0');
+   }
+   if (q != end || length > (long)(8 * size)) {
+       return fail(err, text, slash + 1, ipv6 ? "prefix length out of range 0-128"
+                                              : "prefix length out of range 0-32");
+   }
+   for (size_t i = 0; i < size; i++) {
+       long kept = length - 8 * (long)i;
+       uint8_t bits = kept >= 8 ? 0 : kept <= 0 ? 0xFF : (uint8_t)(0xFF >> kept);
+       hi[i] = lo[i] | bits;
+       lo[i] &= (uint8_t)~bits;
+   }
+   return true;
+}
+
+
+// An IPv4-mapped address is read as the IPv4 one, which is how a
+// dual-stack socket presents IPv4 peers
+static void unmap_rule(FwRule* fwRule)
+{
+   if (fwRule->ipv6 && is_v4_mapped(fwRule->ip6lo) && is_v4_mapped(fwRule->ip6hi)) {
+       uint8_t lo[4], hi[4];
+       memcpy(lo, fwRule->ip6lo + 12, 4);
+       memcpy(hi, fwRule->ip6hi + 12, 4);
+       fwRule->ipv6 = false;
+       memcpy(fwRule->ip1, lo, 4);
+       memcpy(fwRule->ip2, hi, 4);
+   }
+}
+
+
+bool parse_rule(const char* text, FwRule* fwRule, FwParseError* err)
+{
+   const char* p = text;
+   const char* end;
+
+   if (!next_field(&p, &end)) {
+       return fail(err, text, p, "missing address");
+   }
+   // Only an IPv6 address has a colon
+   fwRule->ipv6 = memchr(p, ':', end - p) != NULL;
+   uint8_t* lo = fwRule->ipv6 ? fwRule->ip6lo : fwRule->ip1;
+   uint8_t* hi = fwRule->ipv6 ? fwRule->ip6hi : fwRule->ip2;
+   const char* dash = memchr(p, '-', end - p);
+   const char* slash = memchr(p, '/', end - p);
+   if (dash != NULL) {
+       if (!parse_address(text, p, dash, fwRule->ipv6, lo, err) ||
+           !parse_address(text, dash + 1, end, fwRule->ipv6, hi, err)) {
+           return false;
+       }
+   } else if (slash != NULL) {
+       if (!parse_prefix(text, p, slash, end, fwRule->ipv6, lo, hi, err)) {
+           return false;
+       }
+   } else {
+       if (!parse_address(text, p, end, fwRule->ipv6, lo, err)) {
+           return false;
+       }
+       memcpy(hi, lo, fwRule->ipv6 ? 16 : 4);
+   }
+   unmap_rule(fwRule);
+
+   p = end;
+   if (!next_field(&p, &end)) {
+       return fail(err, text, p, "missing port");
+   }
+   dash = memchr(p, '-', end - p);
+   if (dash != NULL) {
+       return parse_port(text, p, dash, &fwRule->port1, err) &&
+              parse_port(text, dash + 1, end, &fwRule->port2, err);
+   }
+   if (!parse_port(text, p, end, &fwRule->port1, err)) {
+       return false;
+   }
+   fwRule->port2 = fwRule->port1;
+   return true;
+}
+
+
+bool parse_query(const char* text, FwQuery* fwQuery, FwParseError* err)
+{
+   const char* p = text;
+   const char* end;
+
+   if (!next_field(&p, &end)) {
+       return fail(err, text, p, "missing address");
+   }
+   fwQuery->ipv6 = memchr(p, ':', end - p) != NULL;
+   if (!parse_address(text, p, end, fwQuery->ipv6, fwQuery->ipv6 ? fwQuery->qiP6 : fwQuery->qiP, err)) {
+       return false;
+   }
+   if (fwQuery->ipv6 && is_v4_mapped(fwQuery->qiP6)) {
+       fwQuery->ipv6 = false;
+       memcpy(fwQuery->qiP, fwQuery->qiP6 + 12, 4);
+   }
+
+   p = end;
+   if (!next_field(&p, &end)) {
+       return fail(err, text, p, "missing port");
+   }
+   return parse_port(text, p, end, &fwQuery->qPort, err);
+}
@@ -0,0 +1,41 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "server_helper.h"
+
+
+// Where and why a command failed to parse
+typedef struct FwParseError
+{
+   size_t pos;         // offset into the text
+   const char* what;
+} FwParseError;
+
+
+// Single-pass parsers for the argument text of A/D and C. They read text
+// in place, keep no state between calls and allocate nothing.
+//
+// The grammar is the one the old strtok/sscanf parser accepted: fields are
+// split on spaces and anything after the second field is ignored, each
+// octet is read like "%d" (leading white space and a sign allowed, junk
+// after the last octet ignored) and each port like strtol() with nothing
+// left over. Values are range-checked here; address and port order is
+// left to isValidRule().
+//
+// A rule's address may also be a CIDR prefix such as 10.0.0.0/8, which
+// stands for the range of addresses it covers. Any address with a colon
+// is IPv6, in the forms inet_pton() accepts, and sets ipv6; IPv4-mapped
+// addresses (::ffff:a.b.c.d) are read as IPv4.
+
+// Parses "<ip>[-<ip>|/<length>] <port>[-<port>]" into the address and
+// port fields
+bool parse_rule(const char* text, FwRule* fwRule, FwParseError* err);
+
+// Parses "<ip> <port>"
+bool parse_query(const char* text, FwQuery* fwQuery, FwParseError* err);
+
+
+#endif
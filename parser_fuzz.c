@@ -0,0 +1,261 @@
+// Fuzzes parse_rule() and parse_query() against the strtok/sscanf parser
+// they replaced, which is kept below verbatim apart from its diagnostics.
+//
+// Usage: parser_fuzz [iterations] [seed]
+//
+// Numbers longer than nine digits are not generated: the old parser
+// overflowed int on them, which the new one rejects instead. Neither is
+// '/', which the old parser ignored after an address and the new one
+// reads as a CIDR prefix length, nor ':', which starts an IPv6 address.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+
+static bool is_integer(char* pch, int* num)
+{
+   char *endptr;
+   *num = strtol(pch, &endptr, 10);
+   return *endptr == '\0';
+}
+
+
+static bool legacy_rule(char* buffer, FwRule* fwRule)
+{
+    char* save;
+    char* pch = strtok_r(buffer, " ", &save);
+    if (pch == NULL) {
+        return false;
+    }
+
+    char* dashPos = strchr(pch, '-');
+    if (dashPos != NULL) {
+        *dashPos = '\0';
+        int ip1_parts[4], ip2_parts[4];
+        if (sscanf(pch, "%d.%d.%d.%d", &ip1_parts[0], &ip1_parts[1], &ip1_parts[2], &ip1_parts[3]) != 4) {
+            return false;
+        }
+        if (sscanf(dashPos + 1, "%d.%d.%d.%d", &ip2_parts[0], &ip2_parts[1], &ip2_parts[2], &ip2_parts[3]) != 4) {
+            return false;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (ip1_parts[i] < 0 || ip1_parts[i] > 255 || ip2_parts[i] < 0 || ip2_parts[i] > 255) {
+                return false;
+            }
+            fwRule->ip1[i] = (uint8_t)ip1_parts[i];
+            fwRule->ip2[i] = (uint8_t)ip2_parts[i];
+        }
+    } else {
+        int ip_parts[4];
+        if (sscanf(pch, "%d.%d.%d.%d", &ip_parts[0], &ip_parts[1], &ip_parts[2], &ip_parts[3]) != 4) {
+            return false;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (ip_parts[i] < 0 || ip_parts[i] > 255) {
+                return false;
+            }
+            fwRule->ip1[i] = (uint8_t)ip_parts[i];
+        }
+        memcpy(fwRule->ip2, fwRule->ip1, sizeof(fwRule->ip1));
+    }
+
+    pch = strtok_r(NULL, " ", &save);
+    if (pch == NULL) {
+        return false;
+    }
+
+    dashPos = strchr(pch, '-');
+    if (dashPos != NULL) {
+        *dashPos = '\0';
+        if (!is_integer(pch, &fwRule->port1) || !is_integer(dashPos + 1, &fwRule->port2)) {
+            return false;
+        }
+    } else {
+        if (!is_integer(pch, &fwRule->port1)) {
+            return false;
+        }
+        fwRule->port2 = fwRule->port1;
+    }
+    // The port range check used to happen in isValidPort()
+    return fwRule->port1 >= 0 && fwRule->port1 <= 65535 &&
+           fwRule->port2 >= 0 && fwRule->port2 <= 65535;
+}
+
+
+static bool legacy_query(char* buffer, FwQuery* fwQuery)
+{
+   char* save;
+   char* pch = strtok_r(buffer, " ", &save);
+   if (pch == NULL) {
+       return false;
+   }
+
+   int ip_parts[4];
+   if (sscanf(pch, "%d.%d.%d.%d", &ip_parts[0], &ip_parts[1], &ip_parts[2], &ip_parts[3]) != 4) {
+       return false;
+   }
+   for (int i = 0; i < 4; i++) {
+       if (ip_parts[i] < 0 || ip_parts[i] > 255) {
+           return false;
+       }
+       fwQuery->qiP[i] = (uint8_t)ip_parts[i];
+   }
+
+   pch = strtok_r(NULL, " ", &save);
+   if (pch == NULL || !is_integer(pch, &fwQuery->qPort)) {
+       return false;
+   }
+   // The range check used to happen in isValidQueryPort()
+   return fwQuery->qPort >= 0 && fwQuery->qPort <= 65535;
+}
+
+
+static const char* pieces[] = {
+   "0", "1", "9", "10", "255", "256", "65535", "65536", "007", "-", "+",
+   ".", ".", ".", " ", " ", "\t", "\n", "\r", "x", "1.2.3.4", "-1", "+0"
+};
+#define NPIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+
+static void random_digits(char* out, size_t* len)
+{
+   int n = 1 + rand() % 3;
+   for (int i = 0; i < n; i++) {
+       out[(*len)++] = '0' + rand() % 10;
+   }
+}
+
+
+// Builds a command that is usually close to valid, then damages it
+static void generate(char* out, size_t cap)
+{
+   size_t len = 0;
+   if (rand() % 4 == 0) {
+       // Pure noise from the pieces above
+       int n = rand() % 12;
+       for (int i = 0; i < n; i++) {
+           const char* p = pieces[rand() % NPIECES];
+           size_t pl = strlen(p);
+           if (len + pl >= cap) {
+               break;
+           }
+           memcpy(out + len, p, pl);
+           len += pl;
+       }
+   } else {
+       // ip[-ip] port[-port], with some extra fields
+       int ips = 1 + rand() % 2;
+       for (int k = 0; k < ips; k++) {
+           if (k > 0) {
+               out[len++] = '-';
+           }
+           for (int i = 0; i < 4; i++) {
+               if (i > 0) {
+                   out[len++] = '.';
+               }
+               random_digits(out, &len);
+           }
+       }
+       out[len++] = ' ';
+       random_digits(out, &len);
+       if (rand() % 2) {
+           out[len++] = '-';
+           random_digits(out, &len);
+       }
+       if (rand() % 8 == 0) {
+           memcpy(out + len, " extra", 6);
+           len += 6;
+       }
+       // A few random edits
+       int edits = rand() % 4;
+       for (int e = 0; e < edits && len > 0; e++) {
+           size_t at = rand() % len;
+           const char* p = pieces[rand() % NPIECES];
+           switch (rand() % 3) {
+           case 0:
+               memmove(out + at, out + at + 1, len - at - 1);
+               len--;
+               break;
+           case 1:
+               out[at] = p[0];
+               break;
+           default:
+               if (len + 1 < cap) {
+                   memmove(out + at + 1, out + at, len - at);
+                   out[at] = p[0];
+                   len++;
+               }
+               break;
+           }
+       }
+   }
+   out[len] = '\0';
+}
+
+
+// True if text has a run of more than nine digits
+static bool has_long_number(const char* text)
+{
+   int run = 0;
+   for (const char* p = text; *p != '\0'; p++) {
+       run = *p >= '0' && *p <= '9' ? run + 1 : 0;
+       if (run > 9) {
+           return true;
+       }
+   }
+   return false;
+}
+
+
+int main(int argc, char** argv)
+{
+   long iterations = argc > 1 ? atol(argv[1]) : 200000;
+   srand(argc > 2 ? atoi(argv[2]) : 1);
+   long compared = 0, accepted = 0, mismatches = 0;
+
+   for (long it = 0; it < iterations; it++) {
+       char text[128];
+       generate(text, 100);
+       if (has_long_number(text)) {
+           continue;
+       }
+
+       char copy[128];
+       FwParseError err;
+       compared += 2;
+
+       FwRule oldRule, newRule;
+       memset(&oldRule, 0, sizeof(oldRule));
+       memset(&newRule, 0, sizeof(newRule));
+       strcpy(copy, text);
+       bool oldOk = legacy_rule(copy, &oldRule);
+       bool newOk = parse_rule(text, &newRule, &err);
+       if (oldOk != newOk || (oldOk &&
+           (memcmp(oldRule.ip1, newRule.ip1, 4) != 0 || memcmp(oldRule.ip2, newRule.ip2, 4) != 0 ||
+            oldRule.port1 != newRule.port1 || oldRule.port2 != newRule.port2))) {
+           printf("rule mismatch on \"%s\": old %d, new %d\n", text, oldOk, newOk);
+           mismatches++;
+       }
+       accepted += oldOk;
+
+       FwQuery oldQuery, newQuery;
+       memset(&oldQuery, 0, sizeof(oldQuery));
+       memset(&newQuery, 0, sizeof(newQuery));
+       strcpy(copy, text);
+       oldOk = legacy_query(copy, &oldQuery);
+       newOk = parse_query(text, &newQuery, &err);
+       if (oldOk != newOk || (oldOk &&
+           (memcmp(oldQuery.qiP, newQuery.qiP, 4) != 0 || oldQuery.qPort != newQuery.qPort))) {
+           printf("query mismatch on \"%s\": old %d, new %d\n", text, oldOk, newOk);
+           mismatches++;
+       }
+       accepted += oldOk;
+   }
+
+   printf("%ld inputs, %ld accepted, %ld mismatches\n", compared, accepted, mismatches);
+   return mismatches == 0 ? 0 : 1;
+}
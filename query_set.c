@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "query_set.h"
+
+
+static void* xrealloc(void* p, size_t size)
+{
+   p = realloc(p, size);
+   if (p == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   return p;
+}
+
+
+static inline size_t hash_key(const uint64_t* key, size_t width, size_t mask)
+{
+   // Fibonacci hashing spreads neighbouring addresses across the table
+   uint64_t h = key[0];
+   for (size_t w = 1; w < width; w++) {
+       h = (h * 0x9E3779B97F4A7C15ull) ^ key[w];
+   }
+   return (size_t)((h * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+
+static inline bool same_key(const uint64_t* a, const uint64_t* b, size_t width)
+{
+   for (size_t w = 0; w < width; w++) {
+       if (a[w] != b[w]) {
+           return false;
+       }
+   }
+   return true;
+}
+
+
+void query_set_init(QuerySet* set)
+{
+   memset(set, 0, sizeof(*set));
+}
+
+
+void query_set_free(QuerySet* set)
+{
+   free(set->keys);
+   free(set->slots);
+   memset(set, 0, sizeof(*set));
+}
+
+
+static void rehash(QuerySet* set, size_t nslots, size_t width)
+{
+   free(set->slots);
+   set->slots = calloc(nslots, sizeof(uint32_t));
+   if (set->slots == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   set->nslots = nslots;
+   size_t mask = nslots - 1;
+   for (size_t i = 0; i < set->count; i++) {
+       size_t s = hash_key(set->keys + i * width, width, mask);
+       while (set->slots[s] != 0) {
+           s = (s + 1) & mask;
+       }
+       set->slots[s] = (uint32_t)(i + 1);
+   }
+}
+
+
+// Inlined with a constant width, so the IPv4 path compares one word
+static inline bool add_key(QuerySet* set, const uint64_t* key, size_t width)
+{
+   if (set->nslots == 0) {
+       rehash(set, 8, width);
+   }
+   size_t mask = set->nslots - 1;
+   size_t s = hash_key(key, width, mask);
+   while (set->slots[s] != 0) {
+       if (same_key(set->keys + (set->slots[s] - 1) * width, key, width)) {
+           return false;
+       }
+       s = (s + 1) & mask;
+   }
+
+   if (set->count == set->cap) {
+       set->cap = set->cap ? set->cap * 2 : 4;
+       set->keys = xrealloc(set->keys, set->cap * width * sizeof(uint64_t));
+   }
+   memcpy(set->keys + set->count * width, key, width * sizeof(uint64_t));
+   set->count++;
+
+   // Keep the load factor at or below one half
+   if (set->count * 2 > set->nslots) {
+       rehash(set, set->nslots * 2, width);
+   } else {
+       set->slots[s] = (uint32_t)set->count;
+   }
+   return true;
+}
+
+
+static void load_keys(QuerySet* set, const uint64_t* keys, size_t count, size_t width)
+{
+   query_set_free(set);
+   if (count == 0) {
+       return;
+   }
+   set->keys = xrealloc(NULL, count * width * sizeof(uint64_t));
+   memcpy(set->keys, keys, count * width * sizeof(uint64_t));
+   set->count = count;
+   set->cap = count;
+   size_t nslots = 8;
+   while (nslots < count * 2) {
+       nslots *= 2;
+   }
+   rehash(set, nslots, width);
+}
+
+
+bool query_set_add(QuerySet* set, uint64_t key)
+{
+   return add_key(set, &key, 1);
+}
+
+
+void query_set_load(QuerySet* set, const uint64_t* keys, size_t count)
+{
+   load_keys(set, keys, count, 1);
+}
+
+
+bool query_set_add6(QuerySet* set, uint64_t hi, uint64_t lo, uint16_t port)
+{
+   uint64_t key[QUERY6_WORDS] = { hi, lo, port };
+   return add_key(set, key, QUERY6_WORDS);
+}
+
+
+void query_set_load6(QuerySet* set, const uint64_t* keys, size_t count)
+{
+   load_keys(set, keys, count, QUERY6_WORDS);
+}
@@ -0,0 +1,61 @@
+#ifndef QUERY_SET_H
+#define QUERY_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Number of 64-bit words in the key of an IPv6 query: the address
+// halves, then the port
+#define QUERY6_WORDS 3
+
+
+// Accepted queries of one rule, keyed on the packed (ip, port) value.
+//
+// Keys are kept in arrival order in a dense array, which is what L lists;
+// an open-addressing table of positions into that array gives O(1)
+// duplicate detection without comparing query text. An IPv6 rule's set
+// holds QUERY6_WORDS words per key; the caller knows which kind it has.
+typedef struct QuerySet
+{
+   uint64_t* keys;     // in arrival order
+   size_t count;       // keys, not words
+   size_t cap;
+   uint32_t* slots;    // key position + 1, 0 for an empty slot
+   size_t nslots;      // power of two, at least twice count
+} QuerySet;
+
+
+// Packs an address and port into a query key
+static inline uint64_t query_key(uint32_t ip, uint16_t port)
+{
+   return ((uint64_t)ip << 16) | port;
+}
+
+static inline uint32_t query_key_ip(uint64_t key)
+{
+   return (uint32_t)(key >> 16);
+}
+
+static inline uint16_t query_key_port(uint64_t key)
+{
+   return (uint16_t)key;
+}
+
+
+void query_set_init(QuerySet* set);
+void query_set_free(QuerySet* set);
+
+// Adds key; returns false if it was already in the set
+bool query_set_add(QuerySet* set, uint64_t key);
+
+// Replaces the contents with count distinct keys, in that order
+void query_set_load(QuerySet* set, const uint64_t* keys, size_t count);
+
+// The same for the sets of IPv6 rules
+bool query_set_add6(QuerySet* set, uint64_t hi, uint64_t lo, uint16_t port);
+void query_set_load6(QuerySet* set, const uint64_t* keys, size_t count);
+
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "req_log.h"
+#include "server_helper.h"
+
+
+// Spill file offsets are remembered for every this many entries, so
+// paging back seeks close to the first wanted line and reads forward
+#define SPILL_STRIDE 256
+
+
+static FwRequest* ring = NULL;
+static size_t ringCap = 0;
+static uint64_t total = 0;       // commands recorded so far
+
+static FILE* spill = NULL;
+static char* spillName = NULL;
+static uint64_t spilled = 0;     // entries written to the spill file
+static long* marks = NULL;       // offset of entry i * SPILL_STRIDE
+static size_t nmarks = 0;
+static size_t marksCap = 0;
+
+
+void req_log_init(size_t capacity, const char* spillPath)
+{
+   ring = calloc(capacity, sizeof(FwRequest));
+   if (ring == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   ringCap = capacity;
+
+   if (spillPath != NULL) {
+       spill = fopen(spillPath, "a");
+       if (spill == NULL) {
+           perror("ERROR opening history log");
+           exit(1);
+       }
+       // Earlier runs may have left lines in the file
+       fseek(spill, 0, SEEK_END);
+       spillName = strdup(spillPath);
+       if (spillName == NULL) {
+           printf("Memory allocation failed\n");
+           exit(1);
+       }
+   }
+}
+
+
+static void spill_entry(const FwRequest* fwReq)
+{
+   if (spilled % SPILL_STRIDE == 0) {
+       if (nmarks == marksCap) {
+           marksCap = marksCap ? marksCap * 2 : 64;
+           marks = realloc(marks, marksCap * sizeof(long));
+           if (marks == NULL) {
+               printf("Memory allocation failed\n");
+               exit(1);
+           }
+       }
+       marks[nmarks++] = ftell(spill);
+   }
+   fputs(fwReq->RawCmd, spill);
+   fputc('\n', spill);
+   spilled++;
+}
+
+
+void req_log_append(const char* rawCmd)
+{
+   FwRequest* slot = &ring[total % ringCap];
+   if (total >= ringCap && spill != NULL) {
+       spill_entry(slot);
+   }
+   strncpy(slot->RawCmd, rawCmd, MAX_FW_CMD - 1);
+   slot->RawCmd[MAX_FW_CMD - 1] = '\0';
+   slot->Cmd = rawCmd[0];
+   total++;
+}
+
+
+uint64_t req_log_count(void)
+{
+   return total;
+}
+
+
+size_t req_log_read(uint64_t first, size_t count,
+                    bool (*emit)(const char* rawCmd, void* arg), void* arg)
+{
+   if (first < 1) {
+       first = 1;
+   }
+   uint64_t from = first - 1;
+   if (from >= total || count == 0) {
+       return 0;
+   }
+   uint64_t to = count < total - from ? from + count : total;
+
+   uint64_t oldest = total > ringCap ? total - ringCap : 0;
+   size_t emitted = 0;
+   for (uint64_t seq = from > oldest ? from : oldest; seq < to; seq++) {
+       if (!emit(ring[seq % ringCap].RawCmd, arg)) {
+           break;
+       }
+       emitted++;
+   }
+   return emitted;
+}
+
+
+bool req_log_spill_span(uint64_t first, size_t count, ReqLogSpill* span)
+{
+   if (first < 1) {
+       first = 1;
+   }
+   // Entries before oldest are only on disk
+   uint64_t from = first - 1;
+   uint64_t oldest = total > ringCap ? total - ringCap : 0;
+   if (spill == NULL || from >= oldest || count == 0) {
+       return false;
+   }
+   span->from = from;
+   span->to = count < oldest - from ? from + count : oldest;
+   span->mark = from - from % SPILL_STRIDE;
+   span->offset = marks[span->mark / SPILL_STRIDE];
+   fflush(spill);
+   return true;
+}
+
+
+size_t req_log_read_spill(const ReqLogSpill* span,
+                          bool (*emit)(const char* rawCmd, void* arg), void* arg)
+{
+   FILE* in = fopen(spillName, "r");
+   if (in == NULL) {
+       perror("ERROR opening history log");
+       return 0;
+   }
+   fseek(in, span->offset, SEEK_SET);
+
+   uint64_t pos = span->mark;
+   size_t emitted = 0;
+   char line[MAX_FW_CMD + 1];
+   while (pos < span->to && fgets(line, sizeof(line), in) != NULL) {
+       line[strcspn(line, "\n")] = '\0';
+       if (pos >= span->from) {
+           if (!emit(line, arg)) {
+               break;
+           }
+           emitted++;
+       }
+       pos++;
+   }
+   fclose(in);
+   return emitted;
+}
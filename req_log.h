@@ -0,0 +1,55 @@
+#ifndef REQ_LOG_H
+#define REQ_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// History of every command the server received, numbered from 1.
+//
+// The newest entries live in a fixed-capacity ring. When the ring is full
+// each new command overwrites the oldest one, which is first appended to
+// the spill file if one was given, so R can still page back to it. None of
+// these calls lock; the caller serializes them, apart from
+// req_log_read_spill, which only reads what is already in the file.
+
+
+// A run of commands that are only in the spill file
+typedef struct ReqLogSpill
+{
+   uint64_t from;   // entries [from, to) of the file, counted from 0
+   uint64_t to;
+   uint64_t mark;   // entry at offset, at or before from
+   long offset;
+} ReqLogSpill;
+
+
+// Sets up a ring of capacity entries; spillPath may be NULL. Exits if the
+// spill file cannot be opened.
+void req_log_init(size_t capacity, const char* spillPath);
+
+// Records one command; O(1) apart from the occasional spill write
+void req_log_append(const char* rawCmd);
+
+// Number of commands recorded so far
+uint64_t req_log_count(void);
+
+// Calls emit on up to count commands in order, starting with command
+// number first; commands that have left the ring are skipped. Stops early
+// when emit returns false. Returns how many were emitted.
+size_t req_log_read(uint64_t first, size_t count,
+                    bool (*emit)(const char* rawCmd, void* arg), void* arg);
+
+// Fills span with the commands from number first on, up to count of them,
+// that are only in the spill file, and flushes the file so they can be
+// read. Returns false when command first is not in the spill file.
+bool req_log_spill_span(uint64_t first, size_t count, ReqLogSpill* span);
+
+// Calls emit on the commands of span in order, stopping early when emit
+// returns false. Needs no serializing. Returns how many were emitted.
+size_t req_log_read_spill(const ReqLogSpill* span,
+                          bool (*emit)(const char* rawCmd, void* arg), void* arg);
+
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rule_hash.h"
+
+
+static bool same_bounds(const FwRule* a, const FwRule* b)
+{
+   if (a->ipv6 != b->ipv6 || a->port1 != b->port1 || a->port2 != b->port2) {
+       return false;
+   }
+   if (a->ipv6) {
+       return memcmp(a->ip6lo, b->ip6lo, 16) == 0 && memcmp(a->ip6hi, b->ip6hi, 16) == 0;
+   }
+   return memcmp(a->ip1, b->ip1, 4) == 0 && memcmp(a->ip2, b->ip2, 4) == 0;
+}
+
+
+static size_t hash_rule(const FwRule* fwRule, size_t mask)
+{
+   uint64_t ips = ((uint64_t)pack_ip(fwRule->ip1) << 32) | pack_ip(fwRule->ip2);
+   if (fwRule->ipv6) {
+       FwAddr6 lo = pack_ip6(fwRule->ip6lo), hi = pack_ip6(fwRule->ip6hi);
+       ips = ((lo.hi * 0x9E3779B97F4A7C15ull ^ lo.lo) * 0x9E3779B97F4A7C15ull ^ hi.hi) *
+             0x9E3779B97F4A7C15ull ^ hi.lo;
+   }
+   uint64_t ports = ((uint64_t)fwRule->port1 << 16) | (uint64_t)fwRule->port2;
+   uint64_t h = (ips ^ (ports * 0xC2B2AE3D27D4EB4Full)) * 0x9E3779B97F4A7C15ull;
+   return (size_t)(h >> 32) & mask;
+}
+
+
+void rule_hash_init(RuleHash* hash)
+{
+   memset(hash, 0, sizeof(*hash));
+}
+
+
+void rule_hash_free(RuleHash* hash)
+{
+   free(hash->slots);
+   memset(hash, 0, sizeof(*hash));
+}
+
+
+static void place(RuleHash* hash, FwRule* fwRule)
+{
+   size_t mask = hash->nslots - 1;
+   size_t s = hash_rule(fwRule, mask);
+   while (hash->slots[s] != NULL) {
+       s = (s + 1) & mask;
+   }
+   hash->slots[s] = fwRule;
+}
+
+
+static void grow(RuleHash* hash)
+{
+   FwRule** old = hash->slots;
+   size_t oldSlots = hash->nslots;
+   hash->nslots = oldSlots ? oldSlots * 2 : 64;
+   hash->slots = calloc(hash->nslots, sizeof(FwRule*));
+   if (hash->slots == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (size_t i = 0; i < oldSlots; i++) {
+       if (old[i] != NULL) {
+           place(hash, old[i]);
+       }
+   }
+   free(old);
+}
+
+
+FwRule* rule_hash_find(const RuleHash* hash, const FwRule* parsed)
+{
+   if (hash->count == 0) {
+       return NULL;
+   }
+   size_t mask = hash->nslots - 1;
+   for (size_t s = hash_rule(parsed, mask); hash->slots[s] != NULL; s = (s + 1) & mask) {
+       if (same_bounds(hash->slots[s], parsed)) {
+           return hash->slots[s];
+       }
+   }
+   return NULL;
+}
+
+
+void rule_hash_insert(RuleHash* hash, FwRule* fwRule)
+{
+   if ((hash->count + 1) * 2 > hash->nslots) {
+       grow(hash);
+   }
+   place(hash, fwRule);
+   hash->count++;
+}
+
+
+void rule_hash_remove(RuleHash* hash, const FwRule* fwRule)
+{
+   size_t mask = hash->nslots - 1;
+   size_t s = hash_rule(fwRule, mask);
+   while (hash->slots[s] != fwRule) {
+       s = (s + 1) & mask;
+   }
+   // Shift later members of the probe run back so no lookup stops early
+   size_t hole = s;
+   for (size_t i = (s + 1) & mask; hash->slots[i] != NULL; i = (i + 1) & mask) {
+       size_t home = hash_rule(hash->slots[i], mask);
+       // Move it unless its home lies cyclically in (hole, i]
+       if (((i - home) & mask) >= ((i - hole) & mask)) {
+           hash->slots[hole] = hash->slots[i];
+           hole = i;
+       }
+   }
+   hash->slots[hole] = NULL;
+   hash->count--;
+}
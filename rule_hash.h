@@ -0,0 +1,34 @@
+#ifndef RULE_HASH_H
+#define RULE_HASH_H
+
+#include <stddef.h>
+
+#include "server_helper.h"
+
+
+// Stored rules keyed on their parsed bounds (ip1, ip2, port1, port2, or
+// the IPv6 bounds), so "1.2.3.4 22" and "1.2.3.4-1.2.3.4  22" are the same
+// rule. Open addressing with linear probing and backward-shift deletion;
+// the caller serializes all access.
+typedef struct RuleHash
+{
+   FwRule** slots;     // NULL for an empty slot
+   size_t nslots;      // power of two, at least twice count
+   size_t count;
+} RuleHash;
+
+
+void rule_hash_init(RuleHash* hash);
+void rule_hash_free(RuleHash* hash);
+
+// Returns the stored rule with the same bounds as parsed, or NULL
+FwRule* rule_hash_find(const RuleHash* hash, const FwRule* parsed);
+
+// Adds fwRule, which must not have the bounds of a rule already stored
+void rule_hash_insert(RuleHash* hash, FwRule* fwRule);
+
+// Removes fwRule, which must be stored
+void rule_hash_remove(RuleHash* hash, const FwRule* fwRule);
+
+
+#endif
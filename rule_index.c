@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rule_index.h"
+
+
+// Bounds of the front table: 256 slots (1 KB) to 1M slots (4 MB)
+#define FRONT_MIN_BITS 8
+#define FRONT_MAX_BITS 20
+
+
+static void* xmalloc(size_t size)
+{
+   void* p = malloc(size ? size : 1);
+   if (p == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   return p;
+}
+
+
+void rule_index_free(RuleIndex* idx)
+{
+   free(idx->starts);
+   free(idx->offsets);
+   free(idx->rules);
+   free(idx->front);
+   idx->starts = NULL;
+   idx->offsets = NULL;
+   idx->rules = NULL;
+   idx->front = NULL;
+   idx->nseg = 0;
+}
+
+
+static int compare_u32(const void* a, const void* b)
+{
+   uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+   return (x > y) - (x < y);
+}
+
+
+// Index of the segment containing ip
+static size_t find_segment(const uint32_t* starts, size_t nseg, uint32_t ip)
+{
+   // Last segment whose start is <= ip; starts[0] == 0 so one always exists
+   size_t lo = 0, hi = nseg;
+   while (hi - lo > 1) {
+       size_t mid = lo + (hi - lo) / 2;
+       if (starts[mid] <= ip) {
+           lo = mid;
+       } else {
+           hi = mid;
+       }
+   }
+   return lo;
+}
+
+
+// Sizes the front table to about two slots per segment and fills it in
+// one walk over the segment starts
+static void build_front(RuleIndex* idx)
+{
+   int bits = FRONT_MIN_BITS;
+   while (bits < FRONT_MAX_BITS && ((size_t)1 << bits) < 2 * idx->nseg) {
+       bits++;
+   }
+   size_t slots = (size_t)1 << bits;
+   idx->frontShift = 32 - bits;
+   idx->front = xmalloc(slots * sizeof(uint32_t));
+   size_t seg = 0;
+   for (size_t slot = 0; slot < slots; slot++) {
+       uint32_t first = (uint32_t)(slot << idx->frontShift);
+       while (seg + 1 < idx->nseg && idx->starts[seg + 1] <= first) {
+           seg++;
+       }
+       idx->front[slot] = (uint32_t)seg;
+   }
+}
+
+
+size_t rule_index_unique(void* keys, size_t n, size_t width,
+                         int (*compare)(const void*, const void*))
+{
+   if (n == 0) {
+       return 0;
+   }
+   qsort(keys, n, width, compare);
+   char* k = keys;
+   size_t unique = 1;
+   for (size_t i = 1; i < n; i++) {
+       if (compare(k + i * width, k + (unique - 1) * width) != 0) {
+           memcpy(k + unique++ * width, k + i * width, width);
+       }
+   }
+   return unique;
+}
+
+
+bool rule_index_lists(size_t n, size_t nseg, const uint32_t* first, const uint32_t* last,
+                      size_t maxEntries, size_t** offsetsOut, uint32_t** rulesOut)
+{
+   // Count the rules covering each segment with a difference array stored
+   // one slot ahead in offsets, then fill the lists in position order so
+   // each one comes out sorted
+   size_t* offsets = calloc(nseg + 2, sizeof(size_t));
+   if (offsets == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (size_t i = 0; i < n; i++) {
+       offsets[first[i] + 1]++;
+       offsets[last[i] + 2]--;
+   }
+   size_t covering = 0;
+   for (size_t s = 1; s <= nseg; s++) {
+       covering += offsets[s];
+       offsets[s] = offsets[s - 1] + covering;
+   }
+   if (offsets[nseg] > maxEntries) {
+       free(offsets);
+       return false;
+   }
+   uint32_t* rules = xmalloc(offsets[nseg] * sizeof(uint32_t));
+   size_t* cursor = xmalloc(nseg * sizeof(size_t));
+   memcpy(cursor, offsets, nseg * sizeof(size_t));
+   for (size_t i = 0; i < n; i++) {
+       for (size_t s = first[i]; s <= last[i]; s++) {
+           rules[cursor[s]++] = (uint32_t)i;
+       }
+   }
+   free(cursor);
+   *offsetsOut = offsets;
+   *rulesOut = rules;
+   return true;
+}
+
+
+void rule_index_build(RuleIndex* idx, const RuleTable* table)
+{
+   size_t n = table->count;
+   uint32_t* starts = xmalloc((2 * n + 1) * sizeof(uint32_t));
+   size_t nseg = 0;
+   starts[nseg++] = 0;
+   for (size_t i = 0; i < n; i++) {
+       starts[nseg++] = table->ip_lo[i];
+       if (table->ip_hi[i] != UINT32_MAX) {
+           starts[nseg++] = table->ip_hi[i] + 1;
+       }
+   }
+   nseg = rule_index_unique(starts, nseg, sizeof(uint32_t), compare_u32);
+
+   uint32_t* first = xmalloc(n * sizeof(uint32_t));
+   uint32_t* last = xmalloc(n * sizeof(uint32_t));
+   for (size_t i = 0; i < n; i++) {
+       first[i] = (uint32_t)find_segment(starts, nseg, table->ip_lo[i]);
+       last[i] = (uint32_t)find_segment(starts, nseg, table->ip_hi[i]);
+   }
+   size_t* offsets;
+   uint32_t* rules;
+   rule_index_lists(n, nseg, first, last, SIZE_MAX, &offsets, &rules);
+   free(first);
+   free(last);
+
+   idx->starts = starts;
+   idx->offsets = offsets;
+   idx->rules = rules;
+   idx->nseg = nseg;
+   build_front(idx);
+}
+
+
+void rule_index_update(RuleIndex* idx, const RuleIndex* prev, const RuleTable* table,
+                       size_t added, size_t removed)
+{
+   uint32_t lo = 0, hi = 0;
+   uint32_t extra[2];
+   size_t nextra = 0;
+   if (added != RULE_NONE) {
+       lo = table->ip_lo[added];
+       hi = table->ip_hi[added];
+       extra[nextra++] = lo;
+       if (hi != UINT32_MAX) {
+           extra[nextra++] = hi + 1;
+       }
+   }
+
+   // Each new boundary splits a segment and duplicates its list, and the
+   // added rule joins at most every segment
+   size_t maxSeg = prev->nseg + nextra;
+   size_t maxRules = prev->offsets[prev->nseg];
+   for (size_t e = 0; e < nextra; e++) {
+       size_t s = find_segment(prev->starts, prev->nseg, extra[e]);
+       maxRules += prev->offsets[s + 1] - prev->offsets[s];
+   }
+   if (added != RULE_NONE) {
+       maxRules += maxSeg;
+   }
+   uint32_t* starts = xmalloc(maxSeg * sizeof(uint32_t));
+   size_t* offsets = xmalloc((maxSeg + 1) * sizeof(size_t));
+   uint32_t* rules = xmalloc(maxRules * sizeof(uint32_t));
+   size_t nseg = 0, nrules = 0;
+
+   // Walk the old boundaries merged with the new rule's, carrying the old
+   // segment that contains each candidate boundary
+   size_t oi = 0, ei = 0, seg = 0;
+   while (oi < prev->nseg || ei < nextra) {
+       uint32_t b;
+       if (ei < nextra && (oi >= prev->nseg || extra[ei] <= prev->starts[oi])) {
+           b = extra[ei++];
+           if (oi < prev->nseg && prev->starts[oi] == b) {
+               oi++;
+           }
+       } else {
+           b = prev->starts[oi++];
+       }
+       while (seg + 1 < prev->nseg && prev->starts[seg + 1] <= b) {
+           seg++;
+       }
+
+       size_t begin = nrules;
+       for (size_t i = prev->offsets[seg]; i < prev->offsets[seg + 1]; i++) {
+           uint32_t pos = prev->rules[i];
+           if (removed == RULE_NONE || pos < removed) {
+               rules[nrules++] = pos;
+           } else if (pos > removed) {
+               rules[nrules++] = pos - 1;
+           }
+       }
+       if (added != RULE_NONE && b >= lo && b <= hi) {
+           rules[nrules++] = (uint32_t)added;
+       }
+
+       // Merge with the previous segment when coverage did not change
+       if (nseg > 0) {
+           size_t prevBegin = offsets[nseg - 1];
+           size_t prevLen = begin - prevBegin;
+           if (prevLen == nrules - begin &&
+               memcmp(rules + prevBegin, rules + begin, prevLen * sizeof(uint32_t)) == 0) {
+               nrules = begin;
+               continue;
+           }
+       }
+       starts[nseg] = b;
+       offsets[nseg] = begin;
+       nseg++;
+   }
+   offsets[nseg] = nrules;
+
+   rule_index_free(idx);
+   idx->starts = starts;
+   idx->offsets = offsets;
+   idx->rules = rules;
+   idx->nseg = nseg;
+   build_front(idx);
+}
+
+
+size_t rule_index_lookup(const RuleIndex* idx, uint32_t ip, const uint32_t** rules)
+{
+   // ip lies in the slot's first segment or one that starts inside the
+   // slot, which ends no later than the next slot's first segment
+   size_t slot = ip >> idx->frontShift;
+   size_t lo = idx->front[slot];
+   size_t hi = slot + 1 < ((size_t)1 << (32 - idx->frontShift)) ? idx->front[slot + 1] + 1 : idx->nseg;
+   size_t seg = lo + find_segment(idx->starts + lo, hi - lo, ip);
+   *rules = idx->rules + idx->offsets[seg];
+   return idx->offsets[seg + 1] - idx->offsets[seg];
+}
+
+
+size_t rule_index_bytes(const RuleIndex* idx)
+{
+   return idx->nseg * sizeof(uint32_t) + (idx->nseg + 1) * sizeof(size_t) +
+          idx->offsets[idx->nseg] * sizeof(uint32_t) +
+          ((size_t)1 << (32 - idx->frontShift)) * sizeof(uint32_t);
+}
@@ -0,0 +1,77 @@
+#ifndef RULE_INDEX_H
+#define RULE_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rule_table.h"
+
+
+// Marks "no rule" for rule_index_update
+#define RULE_NONE ((size_t)-1)
+
+
+// Sorted elementary-interval table over the packed IPv4 address space.
+//
+// The address space is cut at every rule boundary into segments; segment s
+// covers [starts[s], starts[s + 1]) and lists the RuleTable positions whose
+// address range covers it, in ascending order. A check is a binary search
+// for the segment followed by a port test over its (usually short) list.
+// A boundary only exists where coverage actually changes: a full build
+// cuts only at rule edges, where some rule enters or leaves the list, and
+// rule_index_update merges the neighbours a removed rule leaves identical.
+//
+// Every segment stores its whole list, so n nested ranges take O(n^2)
+// entries in the worst case; rule_index_bytes reports what an index uses.
+//
+// The binary search only runs within one slot of a front table indexed by
+// the top bits of the address, in the style of DIR-24-8 route lookup. The
+// table has about two slots per segment, so a check costs one table read
+// and a search over the one or two segments that start in its slot.
+typedef struct RuleIndex
+{
+   uint32_t* starts;    // segment start addresses, ascending, starts[0] == 0
+   size_t* offsets;     // nseg + 1 offsets into rules
+   uint32_t* rules;     // covering rule positions of each segment
+   size_t nseg;
+   uint32_t* front;     // segment holding the first address of each slot
+   int frontShift;      // 32 minus the bits that pick the slot
+} RuleIndex;
+
+
+void rule_index_free(RuleIndex* idx);
+
+// Builds idx for every rule in table in one sweep
+void rule_index_build(RuleIndex* idx, const RuleTable* table);
+
+// Builds idx from prev with the rule at position `added` of table appended,
+// or with the rule at position `removed` dropped and later positions
+// shifted down. Pass RULE_NONE for the unused one. prev is left intact, so
+// readers may keep using it. Linear in the index size.
+void rule_index_update(RuleIndex* idx, const RuleIndex* prev, const RuleTable* table,
+                       size_t added, size_t removed);
+
+// The steps of a build that do not depend on the address width, shared
+// with the IPv6 index of RuleTable6.
+//
+// Sorts n keys of width bytes with compare and drops the duplicates.
+// Returns how many keys remain.
+size_t rule_index_unique(void* keys, size_t n, size_t width,
+                         int (*compare)(const void*, const void*));
+
+// Lays out the lists of nseg segments for n rules, rule i covering segments
+// first[i] to last[i]: nseg + 1 offsets into the rule positions, with room
+// for one more offset. Returns false and builds nothing if the lists would
+// hold more than maxEntries positions.
+bool rule_index_lists(size_t n, size_t nseg, const uint32_t* first, const uint32_t* last,
+                      size_t maxEntries, size_t** offsets, uint32_t** rules);
+
+// Bytes the index takes, front table included
+size_t rule_index_bytes(const RuleIndex* idx);
+
+// Returns the positions of the rules whose address range covers ip
+size_t rule_index_lookup(const RuleIndex* idx, uint32_t ip, const uint32_t** rules);
+
+
+#endif
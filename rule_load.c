@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rule_load.h"
+#include "parse.h"
+#include "rule_set.h"
+
+
+// Pieces smaller than this are not worth a thread
+#define MIN_PIECE 65536
+
+
+// One thread's share of the file and what it parsed
+typedef struct LoadPiece
+{
+   const char* begin;
+   const char* end;
+   FwRule** rules;
+   size_t count;
+   size_t cap;
+   size_t lines;
+   size_t invalid;
+   size_t firstInvalid;   // line within the piece, from 1; 0 if none
+} LoadPiece;
+
+
+static void add_rule(LoadPiece* piece, FwRule* fwRule)
+{
+   if (piece->count == piece->cap) {
+       piece->cap = piece->cap ? piece->cap * 2 : 1024;
+       piece->rules = realloc(piece->rules, piece->cap * sizeof(FwRule*));
+       if (piece->rules == NULL) {
+           printf("Memory allocation failed\n");
+           exit(1);
+       }
+   }
+   piece->rules[piece->count++] = fwRule;
+}
+
+
+static void* load_piece(void* arg)
+{
+   LoadPiece* piece = arg;
+   const char* p = piece->begin;
+   while (p < piece->end) {
+       const char* nl = memchr(p, '\n', piece->end - p);
+       const char* eol = nl != NULL ? nl : piece->end;
+       size_t len = eol - p;
+       if (len > 0 && p[len - 1] == '\r') {
+           len--;
+       }
+       piece->lines++;
+
+       if (len > 0 && p[0] != '#') {
+           // Same limit as a command sent over the wire, less the "A "
+           char text[MAX_FW_CMD];
+           FwRule parsed;
+           FwParseError err;
+           bool ok = len < MAX_FW_CMD - 2;
+           if (ok) {
+               memcpy(text, p, len);
+               text[len] = '\0';
+               parsed.RawCmd = text;
+               ok = parse_rule(text, &parsed, &err) && isValidRule(&parsed);
+           }
+           if (ok) {
+               add_rule(piece, rule_set_new_rule(&parsed));
+           } else if (piece->invalid++ == 0) {
+               piece->firstInvalid = piece->lines;
+           }
+       }
+       p = eol + 1;
+   }
+   return NULL;
+}
+
+
+bool rule_load_file(const char* path, int threads, RuleLoadResult* result)
+{
+   memset(result, 0, sizeof(*result));
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+       return false;
+   }
+   struct stat st;
+   if (fstat(fd, &st) < 0) {
+       int saved = errno;
+       close(fd);
+       errno = saved;
+       return false;
+   }
+   size_t size = st.st_size;
+   if (size == 0) {
+       close(fd);
+       return true;
+   }
+   const char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+       return false;
+   }
+   madvise((void*)data, size, MADV_SEQUENTIAL);
+
+   size_t npieces = size / MIN_PIECE + 1;
+   if (threads < 1) {
+       threads = 1;
+   }
+   if (npieces > (size_t)threads) {
+       npieces = threads;
+   }
+   LoadPiece* pieces = calloc(npieces, sizeof(LoadPiece));
+   pthread_t* tids = calloc(npieces, sizeof(pthread_t));
+   if (pieces == NULL || tids == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+
+   // Cut at the first line break after each even split point
+   const char* end = data + size;
+   const char* p = data;
+   for (size_t i = 0; i < npieces; i++) {
+       pieces[i].begin = p;
+       const char* cut = i + 1 == npieces ? end : data + size / npieces * (i + 1);
+       if (cut < p) {
+           cut = p;
+       }
+       const char* nl = cut < end ? memchr(cut, '\n', end - cut) : NULL;
+       p = nl != NULL && i + 1 < npieces ? nl + 1 : end;
+       pieces[i].end = p;
+   }
+
+   for (size_t i = 1; i < npieces; i++) {
+       if (pthread_create(&tids[i], NULL, load_piece, &pieces[i]) != 0) {
+           perror("Failed to create thread");
+           exit(1);
+       }
+   }
+   load_piece(&pieces[0]);
+   for (size_t i = 1; i < npieces; i++) {
+       pthread_join(tids[i], NULL);
+   }
+   munmap((void*)data, size);
+
+   // Publish everything at once, in file order
+   size_t total = 0;
+   for (size_t i = 0; i < npieces; i++) {
+       total += pieces[i].count;
+   }
+   FwRule** rules = malloc((total ? total : 1) * sizeof(FwRule*));
+   if (rules == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   size_t lines = 0;
+   size_t parsed = 0;
+   for (size_t i = 0; i < npieces; i++) {
+       memcpy(rules + parsed, pieces[i].rules, pieces[i].count * sizeof(FwRule*));
+       parsed += pieces[i].count;
+       if (pieces[i].invalid > 0 && result->invalid == 0) {
+           result->firstInvalid = lines + pieces[i].firstInvalid;
+       }
+       result->invalid += pieces[i].invalid;
+       lines += pieces[i].lines;
+       free(pieces[i].rules);
+   }
+   result->added = rule_set_add_batch(rules, total);
+   result->duplicates = total - result->added;
+
+   free(rules);
+   free(pieces);
+   free(tids);
+   return true;
+}
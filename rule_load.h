@@ -0,0 +1,28 @@
+#ifndef RULE_LOAD_H
+#define RULE_LOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+typedef struct RuleLoadResult
+{
+   size_t added;
+   size_t duplicates;     // rules already in the set or earlier in the file
+   size_t invalid;        // lines that did not parse or validate
+   size_t firstInvalid;   // line number of the first of them, from 1
+} RuleLoadResult;
+
+
+// Appends every rule in the file at path to the rule set in one version.
+//
+// Each non-blank line not starting with '#' holds what follows "A " in an
+// A command. The file is mapped rather than read, split at line breaks
+// into up to `threads` pieces that are parsed and validated in parallel,
+// and the rules are then published together in file order. Invalid lines
+// and duplicate rules are counted and skipped. Returns false, with errno
+// set, if the file cannot be read.
+bool rule_load_file(const char* path, int threads, RuleLoadResult* result);
+
+
+#endif
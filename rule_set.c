@@ -0,0 +1,350 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rule_set.h"
+#include "epoch.h"
+#include "rule_hash.h"
+#include "slab.h"
+#include "stats.h"
+
+
+// Below this many rules a SIMD scan of the table beats the index
+#define RULE_INDEX_THRESHOLD 64
+
+
+static _Atomic(RuleSet*) current = NULL;
+// Serializes writers; readers never take it
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+// Stored rules; their text lives in the string arena
+static FwSlab rulePool = FW_SLAB_INIT(sizeof(FwRule));
+// Every rule in the current version by its bounds; guarded by writeLock
+static RuleHash ruleHash;
+
+
+static RuleSet* new_version(const RuleSet* prev)
+{
+   RuleSet* rs = calloc(1, sizeof(RuleSet));
+   if (rs == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   rs->generation = prev != NULL ? prev->generation + 1 : 1;
+   return rs;
+}
+
+
+static RuleTable6* new_table6(const RuleTable6* src)
+{
+   RuleTable6* table6 = malloc(sizeof(RuleTable6));
+   if (table6 == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   if (src != NULL) {
+       rule_table6_copy(table6, src);
+   } else {
+       rule_table6_init(table6);
+   }
+   return table6;
+}
+
+
+static void free_table6(void* arg)
+{
+   rule_table6_free(arg);
+   free(arg);
+}
+
+
+// Gives next prev's IPv4 rules and index, for a change that only touches
+// IPv6 rules. Neither is ever modified, so they are shared rather than
+// copied until an IPv4 rule changes.
+static void share_ipv4(RuleSet* next, const RuleSet* prev)
+{
+   next->table = prev->table;
+   next->index = prev->index;
+   next->indexed = prev->indexed;
+}
+
+
+static void free_version(void* arg)
+{
+   RuleSet* rs = arg;
+   rule_table_free(&rs->table);
+   if (rs->indexed) {
+       rule_index_free(&rs->index);
+   }
+   free(rs);
+}
+
+
+// Frees a version whose IPv4 rules and index live on in the next one
+static void free_shared_version(void* arg)
+{
+   free(arg);
+}
+
+
+// Frees a rule and the queries recorded under it
+static void free_rule(void* arg)
+{
+   FwRule* fwRule = arg;
+   query_set_free(&fwRule->queries);
+   slab_strfree(fwRule->RawCmd);
+   slab_free(&rulePool, fwRule);
+}
+
+
+// Makes next current and retires prev, with prev's IPv4 and IPv6 rules
+// unless next shares them. Versions are retired in the order they were
+// published, so shared rules go with the last version that has them.
+// Called with writeLock held; the caller frees what it returns once the
+// lock is dropped.
+static Retired* publish(RuleSet* prev, RuleSet* next, FwRule* dropped)
+{
+   atomic_store(&current, next);
+   if (next->table6 != prev->table6) {
+       epoch_retire(prev->table6, free_table6);
+   }
+   // The IPv4 table and its index are only ever shared together
+   epoch_retire(prev, next->table.cold == prev->table.cold ? free_shared_version : free_version);
+   if (dropped != NULL) {
+       epoch_retire(dropped, free_rule);
+   }
+   return epoch_collect();
+}
+
+
+// Frees a rule that was never published, with any queries loaded into it
+static void discard_rule(FwRule* fwRule)
+{
+   query_set_free(&fwRule->queries);
+   slab_strfree(fwRule->RawCmd);
+   slab_free(&rulePool, fwRule);
+}
+
+
+void rule_set_init(void)
+{
+   RuleSet* rs = new_version(NULL);
+   rule_table_init(&rs->table);
+   rs->table6 = new_table6(NULL);
+   rule_hash_init(&ruleHash);
+   atomic_store(&current, rs);
+}
+
+
+const RuleSet* rule_set_acquire(void)
+{
+   epoch_enter();
+   return atomic_load(&current);
+}
+
+
+void rule_set_release(void)
+{
+   epoch_exit();
+}
+
+
+size_t rule_set_match(const RuleSet* rs, uint32_t ip, uint16_t port, size_t from)
+{
+   const RuleTable* table = &rs->table;
+   if (!rs->indexed) {
+       return rule_table_match(table, ip, port, from);
+   }
+   const uint32_t* candidates;
+   size_t ncandidates = rule_index_lookup(&rs->index, ip, &candidates);
+   for (size_t i = 0; i < ncandidates; i++) {
+       uint32_t pos = candidates[i];
+       if (pos >= from && port >= table->port_lo[pos] && port <= table->port_hi[pos]) {
+           return pos;
+       }
+   }
+   return table->count;
+}
+
+
+FwRule* rule_set_new_rule(const FwRule* parsed)
+{
+   FwRule* fwRule = slab_alloc(&rulePool);
+   *fwRule = *parsed;
+   fwRule->RawCmd = slab_strdup(parsed->RawCmd);
+   query_set_init(&fwRule->queries);
+   return fwRule;
+}
+
+
+bool rule_set_add(const FwRule* parsed)
+{
+   FwRule* fwRule = rule_set_new_rule(parsed);
+
+   uint64_t held = stats_lock(&writeLock, STAT_WRITE_WAIT);
+   if (rule_hash_find(&ruleHash, fwRule) != NULL) {
+       stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+       discard_rule(fwRule);
+       return false;
+   }
+   rule_hash_insert(&ruleHash, fwRule);
+   RuleSet* prev = atomic_load(&current);
+   RuleSet* next = new_version(prev);
+   if (fwRule->ipv6) {
+       share_ipv4(next, prev);
+       next->table6 = new_table6(prev->table6);
+       rule_table6_append(next->table6, fwRule);
+       rule_table6_index(next->table6);
+   } else {
+       next->table6 = prev->table6;
+       rule_table_copy(&next->table, &prev->table);
+       rule_table_append(&next->table, fwRule);
+       if (prev->indexed) {
+           rule_index_update(&next->index, &prev->index, &next->table, next->table.count - 1, RULE_NONE);
+           next->indexed = true;
+       } else if (next->table.count > RULE_INDEX_THRESHOLD) {
+           rule_index_build(&next->index, &next->table);
+           next->indexed = true;
+       }
+   }
+   Retired* garbage = publish(prev, next, NULL);
+   stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+   epoch_free(garbage);
+   return true;
+}
+
+
+size_t rule_set_add_batch(FwRule** rules, size_t n)
+{
+   if (n == 0) {
+       return 0;
+   }
+   uint64_t held = stats_lock(&writeLock, STAT_WRITE_WAIT);
+   RuleSet* prev = atomic_load(&current);
+   RuleSet* next = new_version(prev);
+   // Each family is copied once it gains a rule
+   share_ipv4(next, prev);
+   next->table6 = prev->table6;
+   // Duplicates are compacted to the end of rules and freed after unlock
+   size_t added = 0;
+   for (size_t i = 0; i < n; i++) {
+       FwRule* fwRule = rules[i];
+       if (rule_hash_find(&ruleHash, fwRule) == NULL) {
+           rule_hash_insert(&ruleHash, fwRule);
+           if (!fwRule->ipv6) {
+               if (next->table.cold == prev->table.cold) {
+                   rule_table_copy(&next->table, &prev->table);
+                   next->indexed = false;
+               }
+               rule_table_append(&next->table, fwRule);
+           } else {
+               if (next->table6 == prev->table6) {
+                   next->table6 = new_table6(prev->table6);
+               }
+               rule_table6_append(next->table6, fwRule);
+           }
+           rules[i] = rules[added];
+           rules[added++] = fwRule;
+       }
+   }
+   // One sort-based build beats n incremental updates
+   if (next->table.cold != prev->table.cold && next->table.count > RULE_INDEX_THRESHOLD) {
+       rule_index_build(&next->index, &next->table);
+       next->indexed = true;
+   }
+   if (next->table6 != prev->table6) {
+       rule_table6_index(next->table6);
+   }
+   Retired* garbage = publish(prev, next, NULL);
+   stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+   epoch_free(garbage);
+   for (size_t i = added; i < n; i++) {
+       discard_rule(rules[i]);
+   }
+   return added;
+}
+
+
+void rule_set_clear(void)
+{
+   uint64_t held = stats_lock(&writeLock, STAT_WRITE_WAIT);
+   RuleSet* prev = atomic_load(&current);
+   RuleSet* next = new_version(prev);
+   rule_table_init(&next->table);
+   next->table6 = new_table6(NULL);
+   rule_hash_free(&ruleHash);
+   rule_hash_init(&ruleHash);
+   for (size_t pos = 0; pos < prev->table.count; pos++) {
+       epoch_retire(prev->table.cold[pos], free_rule);
+   }
+   for (size_t pos = 0; pos < prev->table6->count; pos++) {
+       epoch_retire(prev->table6->cold[pos], free_rule);
+   }
+   Retired* garbage = publish(prev, next, NULL);
+   stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+   epoch_free(garbage);
+}
+
+
+// Returns the position of fwRule in rs, which must hold it
+static size_t position_of(const RuleSet* rs, const FwRule* fwRule)
+{
+   const RuleTable* table = &rs->table;
+   if (rs->indexed) {
+       // The rule covers its own lowest address
+       const uint32_t* candidates;
+       size_t n = rule_index_lookup(&rs->index, pack_ip(fwRule->ip1), &candidates);
+       for (size_t i = 0; i < n; i++) {
+           if (table->cold[candidates[i]] == fwRule) {
+               return candidates[i];
+           }
+       }
+   }
+   size_t pos = 0;
+   while (table->cold[pos] != fwRule) {
+       pos++;
+   }
+   return pos;
+}
+
+
+bool rule_set_delete(const FwRule* parsed)
+{
+   uint64_t held = stats_lock(&writeLock, STAT_WRITE_WAIT);
+   FwRule* stored = rule_hash_find(&ruleHash, parsed);
+   if (stored == NULL) {
+       stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+       return false;
+   }
+   rule_hash_remove(&ruleHash, stored);
+   RuleSet* prev = atomic_load(&current);
+   RuleSet* next = new_version(prev);
+   FwRule* dropped;
+   if (stored->ipv6) {
+       share_ipv4(next, prev);
+       next->table6 = new_table6(prev->table6);
+       size_t pos = 0;
+       while (next->table6->cold[pos] != stored) {
+           pos++;
+       }
+       dropped = rule_table6_remove(next->table6, pos);
+       rule_table6_index(next->table6);
+   } else {
+       size_t pos = position_of(prev, stored);
+       next->table6 = prev->table6;
+       rule_table_copy(&next->table, &prev->table);
+       dropped = rule_table_remove(&next->table, pos);
+       // Keep the index a little below the threshold so a table hovering
+       // around it is not rebuilt on every change
+       if (prev->indexed && next->table.count >= RULE_INDEX_THRESHOLD / 2) {
+           rule_index_update(&next->index, &prev->index, &next->table, RULE_NONE, pos);
+           next->indexed = true;
+       }
+   }
+   Retired* garbage = publish(prev, next, dropped);
+   stats_unlock(&writeLock, STAT_WRITE_HOLD, held);
+   // Rules and query sets are only ever freed here, outside writeLock,
+   // and only once no check can still reach them
+   epoch_free(garbage);
+   return true;
+}
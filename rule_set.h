@@ -0,0 +1,73 @@
+#ifndef RULE_SET_H
+#define RULE_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rule_table.h"
+#include "rule_table6.h"
+#include "rule_index.h"
+
+
+// One immutable version of the rule set.
+//
+// Checks read the current version without taking any lock: they pin it
+// with rule_set_acquire() and drop it with rule_set_release(). A and D
+// copy the current version, apply their change to the copy and publish
+// it atomically; the old version is freed by epoch-based reclamation once
+// no reader still holds it. The cold FwRule objects are shared between
+// versions and only freed after the version that dropped them is retired.
+//
+// IPv4 and IPv6 rules live in separate tables, each in the order it was
+// added; a check only looks at the table of its own family. A family's
+// table, and the IPv4 index, are shared by every version until a rule of
+// that family changes.
+typedef struct RuleSet
+{
+   RuleTable table;
+   RuleIndex index;
+   bool indexed;          // index is only kept for larger tables
+   uint64_t generation;   // increases with every published version
+   RuleTable6* table6;
+} RuleSet;
+
+
+// Publishes the initial, empty version
+void rule_set_init(void);
+
+// Pins and returns the current version; never blocks
+const RuleSet* rule_set_acquire(void);
+// Unpins the version returned by the last rule_set_acquire()
+void rule_set_release(void);
+
+// Returns the first position >= from in rs whose rule matches ip and port,
+// or rs->table.count when there is none
+size_t rule_set_match(const RuleSet* rs, uint32_t ip, uint16_t port, size_t from);
+
+// Rules are unique by their bounds: two rules are the same if they have
+// the same ip1, ip2, port1 and port2, however their text is written.
+
+// Publishes a version with a stored copy of parsed appended. Returns false
+// if the set already has the same rule.
+bool rule_set_add(const FwRule* parsed);
+
+// Makes the stored copy of parsed that rule_set_add() would append. Safe
+// to call from several threads.
+FwRule* rule_set_new_rule(const FwRule* parsed);
+
+// Publishes one version with all n rules from rule_set_new_rule()
+// appended in order, building the index once; takes ownership of them.
+// Rules already in the set are freed; the added ones are moved to the
+// front of rules. Returns how many were added.
+size_t rule_set_add_batch(FwRule** rules, size_t n);
+
+// Publishes an empty version; the benchmarks start each rule set afresh
+void rule_set_clear(void);
+
+// Publishes a version without the rule with the same bounds as parsed.
+// Returns false if there is no such rule.
+bool rule_set_delete(const FwRule* parsed);
+
+
+#endif
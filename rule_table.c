@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rule_table.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RULE_TABLE_X86 1
+#endif
+
+
+static void* xrealloc(void* p, size_t size)
+{
+   p = realloc(p, size);
+   if (p == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   return p;
+}
+
+
+void rule_table_init(RuleTable* table)
+{
+   memset(table, 0, sizeof(*table));
+}
+
+
+void rule_table_free(RuleTable* table)
+{
+   free(table->ip_lo);
+   free(table->ip_hi);
+   free(table->port_lo);
+   free(table->port_hi);
+   free(table->cold);
+   memset(table, 0, sizeof(*table));
+}
+
+
+void rule_table_copy(RuleTable* dst, const RuleTable* src)
+{
+   // One spare slot so the common append right after a copy fits
+   size_t cap = src->count + 1;
+   dst->ip_lo = xrealloc(NULL, cap * sizeof(uint32_t));
+   dst->ip_hi = xrealloc(NULL, cap * sizeof(uint32_t));
+   dst->port_lo = xrealloc(NULL, cap * sizeof(uint16_t));
+   dst->port_hi = xrealloc(NULL, cap * sizeof(uint16_t));
+   dst->cold = xrealloc(NULL, cap * sizeof(FwRule*));
+   memcpy(dst->ip_lo, src->ip_lo, src->count * sizeof(uint32_t));
+   memcpy(dst->ip_hi, src->ip_hi, src->count * sizeof(uint32_t));
+   memcpy(dst->port_lo, src->port_lo, src->count * sizeof(uint16_t));
+   memcpy(dst->port_hi, src->port_hi, src->count * sizeof(uint16_t));
+   memcpy(dst->cold, src->cold, src->count * sizeof(FwRule*));
+   dst->count = src->count;
+   dst->cap = cap;
+}
+
+
+void rule_table_append(RuleTable* table, FwRule* fwRule)
+{
+   if (table->count == table->cap) {
+       size_t cap = table->cap ? table->cap * 2 : 16;
+       table->ip_lo = xrealloc(table->ip_lo, cap * sizeof(uint32_t));
+       table->ip_hi = xrealloc(table->ip_hi, cap * sizeof(uint32_t));
+       table->port_lo = xrealloc(table->port_lo, cap * sizeof(uint16_t));
+       table->port_hi = xrealloc(table->port_hi, cap * sizeof(uint16_t));
+       table->cold = xrealloc(table->cold, cap * sizeof(FwRule*));
+       table->cap = cap;
+   }
+   size_t n = table->count++;
+   table->ip_lo[n] = pack_ip(fwRule->ip1);
+   table->ip_hi[n] = pack_ip(fwRule->ip2);
+   table->port_lo[n] = (uint16_t)fwRule->port1;
+   table->port_hi[n] = (uint16_t)fwRule->port2;
+   table->cold[n] = fwRule;
+}
+
+
+FwRule* rule_table_remove(RuleTable* table, size_t pos)
+{
+   FwRule* fwRule = table->cold[pos];
+   size_t tail = table->count - pos - 1;
+   memmove(table->ip_lo + pos, table->ip_lo + pos + 1, tail * sizeof(uint32_t));
+   memmove(table->ip_hi + pos, table->ip_hi + pos + 1, tail * sizeof(uint32_t));
+   memmove(table->port_lo + pos, table->port_lo + pos + 1, tail * sizeof(uint16_t));
+   memmove(table->port_hi + pos, table->port_hi + pos + 1, tail * sizeof(uint16_t));
+   memmove(table->cold + pos, table->cold + pos + 1, tail * sizeof(FwRule*));
+   table->count--;
+   return fwRule;
+}
+
+
+static size_t match_scalar(const RuleTable* table, uint32_t ip, uint16_t port, size_t i)
+{
+   for (; i < table->count; i++) {
+       if (ip >= table->ip_lo[i] && ip <= table->ip_hi[i] &&
+           port >= table->port_lo[i] && port <= table->port_hi[i]) {
+           return i;
+       }
+   }
+   return table->count;
+}
+
+
+#ifdef RULE_TABLE_X86
+// The compares are signed, so addresses are biased by 2^31 to order them
+// as unsigned. Ports are widened to 32-bit lanes and need no bias.
+__attribute__((target("avx2")))
+static size_t match_avx2(const RuleTable* table, uint32_t ip, uint16_t port, size_t i)
+{
+   const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+   const __m256i qip = _mm256_set1_epi32((int32_t)(ip ^ 0x80000000u));
+   const __m256i qport = _mm256_set1_epi32(port);
+   for (; i + 8 <= table->count; i += 8) {
+       __m256i lo = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(table->ip_lo + i)), bias);
+       __m256i hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(table->ip_hi + i)), bias);
+       __m256i plo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(table->port_lo + i)));
+       __m256i phi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(table->port_hi + i)));
+       __m256i miss = _mm256_or_si256(_mm256_cmpgt_epi32(lo, qip), _mm256_cmpgt_epi32(qip, hi));
+       miss = _mm256_or_si256(miss, _mm256_cmpgt_epi32(plo, qport));
+       miss = _mm256_or_si256(miss, _mm256_cmpgt_epi32(qport, phi));
+       unsigned hit = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xffu;
+       if (hit) {
+           return i + (size_t)__builtin_ctz(hit);
+       }
+   }
+   return match_scalar(table, ip, port, i);
+}
+
+
+__attribute__((target("sse4.1")))
+static size_t match_sse41(const RuleTable* table, uint32_t ip, uint16_t port, size_t i)
+{
+   const __m128i bias = _mm_set1_epi32(INT32_MIN);
+   const __m128i qip = _mm_set1_epi32((int32_t)(ip ^ 0x80000000u));
+   const __m128i qport = _mm_set1_epi32(port);
+   for (; i + 4 <= table->count; i += 4) {
+       __m128i lo = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(table->ip_lo + i)), bias);
+       __m128i hi = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(table->ip_hi + i)), bias);
+       __m128i plo = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(table->port_lo + i)));
+       __m128i phi = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(table->port_hi + i)));
+       __m128i miss = _mm_or_si128(_mm_cmpgt_epi32(lo, qip), _mm_cmpgt_epi32(qip, hi));
+       miss = _mm_or_si128(miss, _mm_cmpgt_epi32(plo, qport));
+       miss = _mm_or_si128(miss, _mm_cmpgt_epi32(qport, phi));
+       unsigned hit = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xfu;
+       if (hit) {
+           return i + (size_t)__builtin_ctz(hit);
+       }
+   }
+   return match_scalar(table, ip, port, i);
+}
+#endif
+
+
+#ifdef RULE_TABLE_X86
+static size_t (*kernel)(const RuleTable*, uint32_t, uint16_t, size_t) = match_scalar;
+static pthread_once_t kernelOnce = PTHREAD_ONCE_INIT;
+
+
+// Picks the widest kernel the CPU runs, once for the whole process
+static void pick_kernel(void)
+{
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+       kernel = match_avx2;
+   } else if (__builtin_cpu_supports("sse4.1")) {
+       kernel = match_sse41;
+   }
+}
+#endif
+
+
+size_t rule_table_match(const RuleTable* table, uint32_t ip, uint16_t port, size_t from)
+{
+#ifdef RULE_TABLE_X86
+   pthread_once(&kernelOnce, pick_kernel);
+   return kernel(table, ip, port, from);
+#else
+   return match_scalar(table, ip, port, from);
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef RULE_TABLE_H
+#define RULE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server_helper.h"
+
+
+// Rules in list order, stored column-wise. The fields a check touches live
+// in their own contiguous arrays so a scan streams through them; the raw
+// command text and accepted queries stay behind the cold pointer.
+typedef struct RuleTable
+{
+   uint32_t* ip_lo;
+   uint32_t* ip_hi;
+   uint16_t* port_lo;
+   uint16_t* port_hi;
+   FwRule** cold;
+   size_t count;
+   size_t cap;
+} RuleTable;
+
+
+void rule_table_init(RuleTable* table);
+void rule_table_free(RuleTable* table);
+
+// Makes dst an independent copy of src's arrays; the cold FwRule objects
+// are shared, not copied
+void rule_table_copy(RuleTable* dst, const RuleTable* src);
+
+// Appends a parsed rule; the table takes ownership of fwRule
+void rule_table_append(RuleTable* table, FwRule* fwRule);
+
+// Removes the rule at pos, shifting later rules down. The cold FwRule is
+// returned to the caller to free.
+FwRule* rule_table_remove(RuleTable* table, size_t pos);
+
+// Returns the first position >= from whose rule matches ip and port, or
+// table->count when none does. Uses AVX2 or SSE4.1 when the CPU has them.
+size_t rule_table_match(const RuleTable* table, uint32_t ip, uint16_t port, size_t from);
+
+
+#endif
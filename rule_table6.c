@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rule_table6.h"
+#include "rule_index.h"
+
+
+// Below this many rules a scan of the table beats the index
+#define RULE6_INDEX_THRESHOLD 64
+// Caps the segment lists at 16 MB; nested ranges take O(n^2) entries
+#define RULE6_INDEX_MAX_ENTRIES ((size_t)1 << 22)
+
+
+static void* xrealloc(void* p, size_t size)
+{
+   p = realloc(p, size ? size : 1);
+   if (p == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   return p;
+}
+
+
+static inline bool addr6_le(FwAddr6 a, FwAddr6 b)
+{
+   return a.hi < b.hi || (a.hi == b.hi && a.lo <= b.lo);
+}
+
+
+static inline bool addr6_is_max(FwAddr6 a)
+{
+   return a.hi == UINT64_MAX && a.lo == UINT64_MAX;
+}
+
+
+static inline FwAddr6 addr6_next(FwAddr6 a)
+{
+   FwAddr6 next = { a.hi + (a.lo == UINT64_MAX), a.lo + 1 };
+   return next;
+}
+
+
+static void drop_index(RuleTable6* table)
+{
+   free(table->starts);
+   free(table->offsets);
+   free(table->rules);
+   table->starts = NULL;
+   table->offsets = NULL;
+   table->rules = NULL;
+   table->nseg = 0;
+}
+
+
+void rule_table6_init(RuleTable6* table)
+{
+   memset(table, 0, sizeof(*table));
+}
+
+
+void rule_table6_free(RuleTable6* table)
+{
+   drop_index(table);
+   free(table->ip_lo);
+   free(table->ip_hi);
+   free(table->port_lo);
+   free(table->port_hi);
+   free(table->cold);
+   memset(table, 0, sizeof(*table));
+}
+
+
+static void grow(RuleTable6* table, size_t cap)
+{
+   table->ip_lo = xrealloc(table->ip_lo, cap * sizeof(FwAddr6));
+   table->ip_hi = xrealloc(table->ip_hi, cap * sizeof(FwAddr6));
+   table->port_lo = xrealloc(table->port_lo, cap * sizeof(uint16_t));
+   table->port_hi = xrealloc(table->port_hi, cap * sizeof(uint16_t));
+   table->cold = xrealloc(table->cold, cap * sizeof(FwRule*));
+   table->cap = cap;
+}
+
+
+void rule_table6_copy(RuleTable6* dst, const RuleTable6* src)
+{
+   rule_table6_init(dst);
+   // One spare slot so the common append right after a copy fits
+   grow(dst, src->count + 1);
+   memcpy(dst->ip_lo, src->ip_lo, src->count * sizeof(FwAddr6));
+   memcpy(dst->ip_hi, src->ip_hi, src->count * sizeof(FwAddr6));
+   memcpy(dst->port_lo, src->port_lo, src->count * sizeof(uint16_t));
+   memcpy(dst->port_hi, src->port_hi, src->count * sizeof(uint16_t));
+   memcpy(dst->cold, src->cold, src->count * sizeof(FwRule*));
+   dst->count = src->count;
+}
+
+
+void rule_table6_append(RuleTable6* table, FwRule* fwRule)
+{
+   if (table->count == table->cap) {
+       grow(table, table->cap ? table->cap * 2 : 16);
+   }
+   size_t n = table->count++;
+   table->ip_lo[n] = pack_ip6(fwRule->ip6lo);
+   table->ip_hi[n] = pack_ip6(fwRule->ip6hi);
+   table->port_lo[n] = (uint16_t)fwRule->port1;
+   table->port_hi[n] = (uint16_t)fwRule->port2;
+   table->cold[n] = fwRule;
+}
+
+
+FwRule* rule_table6_remove(RuleTable6* table, size_t pos)
+{
+   FwRule* fwRule = table->cold[pos];
+   size_t tail = table->count - pos - 1;
+   memmove(table->ip_lo + pos, table->ip_lo + pos + 1, tail * sizeof(FwAddr6));
+   memmove(table->ip_hi + pos, table->ip_hi + pos + 1, tail * sizeof(FwAddr6));
+   memmove(table->port_lo + pos, table->port_lo + pos + 1, tail * sizeof(uint16_t));
+   memmove(table->port_hi + pos, table->port_hi + pos + 1, tail * sizeof(uint16_t));
+   memmove(table->cold + pos, table->cold + pos + 1, tail * sizeof(FwRule*));
+   table->count--;
+   return fwRule;
+}
+
+
+static int compare_addr6(const void* a, const void* b)
+{
+   FwAddr6 x = *(const FwAddr6*)a, y = *(const FwAddr6*)b;
+   if (x.hi != y.hi) {
+       return x.hi < y.hi ? -1 : 1;
+   }
+   return (x.lo > y.lo) - (x.lo < y.lo);
+}
+
+
+// Index of the segment containing ip: the last one starting at or below it
+static size_t find_segment(const FwAddr6* starts, size_t nseg, FwAddr6 ip)
+{
+   size_t lo = 0, hi = nseg;
+   while (hi - lo > 1) {
+       size_t mid = lo + (hi - lo) / 2;
+       if (addr6_le(starts[mid], ip)) {
+           lo = mid;
+       } else {
+           hi = mid;
+       }
+   }
+   return lo;
+}
+
+
+void rule_table6_index(RuleTable6* table)
+{
+   drop_index(table);
+   size_t n = table->count;
+   if (n <= RULE6_INDEX_THRESHOLD) {
+       return;
+   }
+   FwAddr6* starts = xrealloc(NULL, (2 * n + 1) * sizeof(FwAddr6));
+   size_t nseg = 0;
+   starts[nseg++] = (FwAddr6){ 0, 0 };
+   for (size_t i = 0; i < n; i++) {
+       starts[nseg++] = table->ip_lo[i];
+       if (!addr6_is_max(table->ip_hi[i])) {
+           starts[nseg++] = addr6_next(table->ip_hi[i]);
+       }
+   }
+   nseg = rule_index_unique(starts, nseg, sizeof(FwAddr6), compare_addr6);
+
+   uint32_t* first = xrealloc(NULL, n * sizeof(uint32_t));
+   uint32_t* last = xrealloc(NULL, n * sizeof(uint32_t));
+   for (size_t i = 0; i < n; i++) {
+       first[i] = (uint32_t)find_segment(starts, nseg, table->ip_lo[i]);
+       last[i] = (uint32_t)find_segment(starts, nseg, table->ip_hi[i]);
+   }
+   size_t* offsets;
+   uint32_t* rules;
+   bool built = rule_index_lists(n, nseg, first, last, RULE6_INDEX_MAX_ENTRIES, &offsets, &rules);
+   free(first);
+   free(last);
+   if (!built) {
+       // Deeply nested ranges; checks scan the table instead
+       free(starts);
+       return;
+   }
+
+   table->starts = starts;
+   table->offsets = offsets;
+   table->rules = rules;
+   table->nseg = nseg;
+}
+
+
+size_t rule_table6_match(const RuleTable6* table, FwAddr6 ip, uint16_t port, size_t from)
+{
+   if (table->nseg == 0) {
+       for (size_t pos = from; pos < table->count; pos++) {
+           if (addr6_le(table->ip_lo[pos], ip) && addr6_le(ip, table->ip_hi[pos]) &&
+               port >= table->port_lo[pos] && port <= table->port_hi[pos]) {
+               return pos;
+           }
+       }
+       return table->count;
+   }
+   size_t seg = find_segment(table->starts, table->nseg, ip);
+   for (size_t i = table->offsets[seg]; i < table->offsets[seg + 1]; i++) {
+       uint32_t pos = table->rules[i];
+       if (pos >= from && port >= table->port_lo[pos] && port <= table->port_hi[pos]) {
+           return pos;
+       }
+   }
+   return table->count;
+}
+
+
+size_t rule_table6_bytes(const RuleTable6* table)
+{
+   size_t bytes = sizeof(RuleTable6) +
+                  table->cap * (2 * sizeof(FwAddr6) + 2 * sizeof(uint16_t) + sizeof(FwRule*));
+   if (table->nseg > 0) {
+       bytes += table->nseg * sizeof(FwAddr6) + (table->nseg + 2) * sizeof(size_t) +
+                table->offsets[table->nseg] * sizeof(uint32_t);
+   }
+   for (size_t pos = 0; pos < table->count; pos++) {
+       bytes += sizeof(FwRule) + strlen(table->cold[pos]->RawCmd) + 1;
+   }
+   return bytes;
+}
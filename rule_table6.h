@@ -0,0 +1,63 @@
+#ifndef RULE_TABLE6_H
+#define RULE_TABLE6_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "server_helper.h"
+
+
+// IPv6 rules in list order, stored column-wise like RuleTable.
+//
+// Addresses are kept as two 64-bit halves and compared a word at a time.
+// Past RULE6_INDEX_THRESHOLD rules the table also carries the kind of
+// elementary-interval index RuleIndex keeps for IPv4: the 128-bit space
+// is cut at every rule boundary and each segment lists the positions
+// covering it, so a check is a binary search and a port test over a short
+// list. The index is rebuilt rather than patched when the rules change;
+// IPv6 policies are expected to be much smaller than IPv4 ones. Every
+// segment stores its whole list, so n nested ranges need O(n^2) entries;
+// past a fixed cap the table is left unindexed and scanned.
+typedef struct RuleTable6
+{
+   FwAddr6* ip_lo;
+   FwAddr6* ip_hi;
+   uint16_t* port_lo;
+   uint16_t* port_hi;
+   FwRule** cold;
+   size_t count;
+   size_t cap;
+
+   FwAddr6* starts;     // segment starts, ascending, starts[0] is ::
+   size_t* offsets;     // nseg + 1 offsets into rules
+   uint32_t* rules;     // covering rule positions of each segment
+   size_t nseg;         // 0 while the table is not indexed
+} RuleTable6;
+
+
+void rule_table6_init(RuleTable6* table);
+void rule_table6_free(RuleTable6* table);
+
+// Makes dst an independent copy of src's rules, without the index. The
+// cold FwRule objects are shared, not copied.
+void rule_table6_copy(RuleTable6* dst, const RuleTable6* src);
+
+// Appends a parsed IPv6 rule; the table takes ownership of fwRule
+void rule_table6_append(RuleTable6* table, FwRule* fwRule);
+
+// Removes the rule at pos, shifting later rules down. The cold FwRule is
+// returned to the caller to free.
+FwRule* rule_table6_remove(RuleTable6* table, size_t pos);
+
+// Rebuilds the index for the current rules, or drops it for a small table
+void rule_table6_index(RuleTable6* table);
+
+// Returns the first position >= from whose rule matches ip and port, or
+// table->count when none does
+size_t rule_table6_match(const RuleTable6* table, FwAddr6 ip, uint16_t port, size_t from);
+
+// Bytes the table and its rules take, apart from accepted queries
+size_t rule_table6_bytes(const RuleTable6* table);
+
+
+#endif
@@ -1,3 +1,4 @@
+#include <limits.h>      // for PATH_MAX
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,55 +11,43 @@
 #include <pthread.h>
 #include <signal.h>
 
+#include "server_helper.h"
+#include "rule_set.h"
+#include "conn.h"
+#include "flow_cache.h"
+#include "parse.h"
+#include "fw_proto.h"
+#include "req_log.h"
+#include "rule_load.h"
+#include "snapshot.h"
+#include "stats.h"
 
 
 
-#define MAX_FW_CMD 255
 
-
-typedef struct CmdArg
-{
-   bool is_interactive;
-   int port;
-} CmdArg;
-
-
-typedef struct FwRequest
-{
-   char RawCmd[MAX_FW_CMD];
-   char Cmd;
-   struct FwRequest* pNext;
-} FwRequest;
+// Global variables
+pthread_mutex_t history_lock;  // request history
+int historySize;               // commands kept in memory for R
+int loadThreads;               // threads that parse a rule file
+const char* snapshotFile;      // default target of W, or NULL
+const char* ruleFile;          // default source of B, or NULL
+int server_sockfd;
 
 
-typedef struct FwQuery
-{
-   char RawCmd[MAX_FW_CMD];
-   uint8_t qiP[4];
-   int qPort;
-   struct FwQuery* pNext;
-} FwQuery;
+// Striped so that checks recording under different rules rarely share a
+// lock; each stripe sits on its own cache line
+static struct {
+   pthread_mutex_t mutex;
+   char pad[64 - sizeof(pthread_mutex_t) % 64];
+} queryLocks[QUERY_LOCK_STRIPES];
 
 
-typedef struct FwRule
+pthread_mutex_t* query_lock_for(const FwRule* fwRule)
 {
-   char RawCmd[MAX_FW_CMD];
-   uint8_t ip1[4];
-   uint8_t ip2[4];
-   int port1;
-   int port2;
-
-
-   struct FwRule* pNext;
-   struct FwQuery* qHead;
-} FwRule;
-
-
-// Global variables
-FwRule * fwRuleHead = NULL;
-FwRequest* fwReqHead = NULL;
-pthread_mutex_t lock;
-int server_sockfd;
+   // A rule keeps its address in every version, so it keeps its stripe
+   uintptr_t p = (uintptr_t)fwRule;
+   return &queryLocks[((p >> 6) ^ (p >> 16)) % QUERY_LOCK_STRIPES].mutex;
+}
 
 
 bool is_digit(char c)
@@ -75,41 +64,10 @@ bool is_integer(char* pch, int* num)
 }
 
 
-// Adds a request to the end of the linked list
-void add_to_Req_list(FwRequest* fwReq, FwRequest** fwReqHead)
-{
-   if (*fwReqHead == NULL)
-   {
-       *fwReqHead = fwReq;
-       return;
-   }
-   FwRequest* cur = *fwReqHead;
-   while (cur->pNext != NULL)
-   {
-       cur = cur->pNext;
-   }
-   cur->pNext = fwReq;
-}
-
-
-// Adds a rule to the end of the linked list
-void add_to_rule_list(FwRule* fwRule, FwRule** fwRuleHead)
-{
-   if (*fwRuleHead == NULL)
-   {
-       *fwRuleHead = fwRule;
-       return;
-   }
-   FwRule* cur = *fwRuleHead;
-   while (cur->pNext != NULL)
-   {
-       cur = cur->pNext;
-   }
-   cur->pNext = fwRule;
-}
-
-
 bool isValidIP(FwRule* fwRule) {
+   if (fwRule->ipv6) {
+       return memcmp(fwRule->ip6lo, fwRule->ip6hi, 16) <= 0;
+   }
    for (int i = 0; i < 4; i++) {
        if (fwRule->ip1[i] < 0 || fwRule->ip1[i] > 255 || fwRule->ip2[i] < 0 || fwRule->ip2[i] > 255) {
            return false;
@@ -155,183 +113,131 @@ bool isValidRule(FwRule* fwRule)
 }
 
 
+void print_usage(char* prog)
+{
+   printf("Usage: %s [-e threads|epoll|pool|reuseport|uring] [-t threads] [-q depth] [-b backlog] [-n history] [-l history-log] [-r rule-file] [-s snapshot] [-m stats-file] (-i | <port>)\n", prog);
+}
+
+
 bool process_args(int argc, char** argv, CmdArg* pcmd)
 {
    pcmd->is_interactive = false;
    pcmd->port = 0;
+   pcmd->engine = ENGINE_THREADS;
+   pcmd->queue_depth = 1024;
+   pcmd->backlog = SOMAXCONN;
+   pcmd->history = 4096;
+   pcmd->history_log = NULL;
+   pcmd->rule_file = NULL;
+   pcmd->snapshot_file = NULL;
+   pcmd->stats_file = NULL;
+   pcmd->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (pcmd->threads < 1) {
+       pcmd->threads = 1;
+   }
 
 
-   if (argc != 2) {
-       return false;
+   int opt;
+   while ((opt = getopt(argc, argv, "ie:t:q:b:n:l:r:s:m:")) != -1) {
+       switch (opt) {
+       case 'i':
+           pcmd->is_interactive = true;
+           break;
+       case 'e':
+           if (strcmp(optarg, "threads") == 0) {
+               pcmd->engine = ENGINE_THREADS;
+           } else if (strcmp(optarg, "epoll") == 0) {
+               pcmd->engine = ENGINE_EPOLL;
+           } else if (strcmp(optarg, "pool") == 0) {
+               pcmd->engine = ENGINE_POOL;
+           } else if (strcmp(optarg, "reuseport") == 0) {
+               pcmd->engine = ENGINE_REUSEPORT;
+           } else if (strcmp(optarg, "uring") == 0) {
+               pcmd->engine = ENGINE_URING;
+           } else {
+               return false;
+           }
+           break;
+       case 't':
+           if (!is_integer(optarg, &pcmd->threads) || pcmd->threads < 1) {
+               return false;
+           }
+           break;
+       case 'q':
+           if (!is_integer(optarg, &pcmd->queue_depth) || pcmd->queue_depth < 1) {
+               return false;
+           }
+           break;
+       case 'b':
+           if (!is_integer(optarg, &pcmd->backlog) || pcmd->backlog < 1) {
+               return false;
+           }
+           break;
+       case 'n':
+           if (!is_integer(optarg, &pcmd->history) || pcmd->history < 1) {
+               return false;
+           }
+           break;
+       case 'l':
+           pcmd->history_log = optarg;
+           break;
+       case 'r':
+           pcmd->rule_file = optarg;
+           break;
+       case 's':
+           pcmd->snapshot_file = optarg;
+           break;
+       case 'm':
+           pcmd->stats_file = optarg;
+           break;
+       default:
+           return false;
+       }
    }
 
 
-   if (strcmp(argv[1], "-i") == 0){
-       pcmd->is_interactive = true;
-       return true;
-   } else {
-       if (is_integer(argv[1], &pcmd->port)){
-           pcmd->is_interactive = false;
-           return true;
-       }
+   // Exactly one mode: -i or a port
+   if (pcmd->is_interactive) {
+       return optind == argc;
    }
-   return false;
+   if (optind + 1 != argc) {
+       return false;
+   }
+   return is_integer(argv[optind], &pcmd->port);
 }
 
 
-FwRule* process_rule_cmd(char* buffer)
+// Skips the command letter and the space after it
+char* cmd_args(char* buffer)
 {
-    FwRule* fwRule = (FwRule*)malloc(sizeof(FwRule));
-    if (fwRule == NULL) {
-        printf("Memory allocation failed\n");
-        exit(1);
-    }
-    fwRule->pNext = NULL;
-    fwRule->qHead = NULL;
-    strcpy(fwRule->RawCmd, buffer);
-
-    // Initialize the fields
-    memset(fwRule->ip1, 0, sizeof(fwRule->ip1));
-    memset(fwRule->ip2, 0, sizeof(fwRule->ip2));
-    fwRule->port1 = 0;
-    fwRule->port2 = 0;
-
-    // Split the input string by spaces
-    char* pch = strtok(buffer, " ");
-    if (pch == NULL) {
-        printf("Invalid Rule\n");
-        free(fwRule);
-        return NULL;
-    }
-
-    // Process the IP address part
-    char* dashPos = strchr(pch, '-');
-    if (dashPos != NULL) {
-        *dashPos = '\0';
-        int ip1_parts[4], ip2_parts[4];
-        if (sscanf(pch, "%d.%d.%d.%d", &ip1_parts[0], &ip1_parts[1], &ip1_parts[2], &ip1_parts[3]) != 4) {
-            printf("Invalid IP address: %s\n", pch);
-            free(fwRule);
-            return NULL;
-        }
-        if (sscanf(dashPos + 1, "%d.%d.%d.%d", &ip2_parts[0], &ip2_parts[1], &ip2_parts[2], &ip2_parts[3]) != 4) {
-            printf("Invalid IP address: %s\n", dashPos + 1);
-            free(fwRule);
-            return NULL;
-        }
-        // Validate and assign IP parts
-        for (int i = 0; i < 4; i++) {
-            if (ip1_parts[i] < 0 || ip1_parts[i] > 255 || ip2_parts[i] < 0 || ip2_parts[i] > 255) {
-                printf("Invalid IP address: Out of range 0-255\n");
-                free(fwRule);
-                return NULL;
-            }
-            fwRule->ip1[i] = (uint8_t)ip1_parts[i];
-            fwRule->ip2[i] = (uint8_t)ip2_parts[i];
-        }
-    } else {
-        int ip_parts[4];
-        if (sscanf(pch, "%d.%d.%d.%d", &ip_parts[0], &ip_parts[1], &ip_parts[2], &ip_parts[3]) != 4) {
-            printf("Invalid IP address: %s\n", pch);
-            free(fwRule);
-            return NULL;
-        }
-        // Validate and assign IP parts
-        for (int i = 0; i < 4; i++) {
-            if (ip_parts[i] < 0 || ip_parts[i] > 255) {
-                printf("Invalid IP address: Out of range 0-255\n");
-                free(fwRule);
-                return NULL;
-            }
-            fwRule->ip1[i] = (uint8_t)ip_parts[i];
-        }
-        memcpy(fwRule->ip2, fwRule->ip1, sizeof(fwRule->ip1));
-    }
-
-    // Process the port part
-    pch = strtok(NULL, " ");
-    if (pch == NULL) {
-        printf("Invalid Rule: Missing port\n");
-        free(fwRule);
-        return NULL;
-    }
-
-    dashPos = strchr(pch, '-');
-    if (dashPos != NULL) {
-        *dashPos = '\0';
-        if (!is_integer(pch, &fwRule->port1) || !is_integer(dashPos + 1, &fwRule->port2)) {
-            printf("Invalid port numbers\n");
-            free(fwRule);
-            return NULL;
-        }
-    } else {
-        if (!is_integer(pch, &fwRule->port1)) {
-            printf("Invalid port number\n");
-            free(fwRule);
-            return NULL;
-        }
-        fwRule->port2 = fwRule->port1;
-    }
-
-    return fwRule;
+   return buffer[0] != '\0' && buffer[1] != '\0' ? buffer + 2 : buffer + strlen(buffer);
 }
 
 
-
-
-FwQuery* process_query_cmd(char* buffer)
+// Parses "<ip>[-<ip>|/<length>] <port>[-<port>]" into fwRule. fwRule->RawCmd is
+// left pointing at text, which the caller keeps alive.
+bool process_rule_cmd(char* text, FwRule* fwRule)
 {
-   FwQuery* fwQuery = (FwQuery*)malloc(sizeof(FwQuery));
-   if (fwQuery == NULL) {
-       printf("Memory allocation failed\n");
-       exit(1);
-   }
-   fwQuery->pNext = NULL;
-   strcpy(fwQuery->RawCmd, buffer);
-
-
-   // Split the query by space
-   char* pch = strtok(buffer, " ");
-   if (pch == NULL) {
-       printf("Invalid Query\n");
-       free(fwQuery);
-       return NULL;
+   FwParseError err;
+   fwRule->RawCmd = text;
+   query_set_init(&fwRule->queries);
+   if (!parse_rule(text, fwRule, &err)) {
+       printf("Invalid rule at column %zu: %s\n", err.pos + 1, err.what);
+       return false;
    }
-
-
-  int ip_parts[4];
-if (sscanf(pch, "%d.%d.%d.%d", &ip_parts[0], &ip_parts[1], &ip_parts[2], &ip_parts[3]) != 4) {
-   printf("Invalid IP address: %s\n", pch);
-   free(fwQuery);
-   return NULL;
-}
-// Validate and assign IP parts
-for (int i = 0; i < 4; i++) {
-   if (ip_parts[i] < 0 || ip_parts[i] > 255) {
-       printf("Invalid IP address: Out of range 0-255\n");
-       free(fwQuery);
-       return NULL;
-   }
-   fwQuery->qiP[i] = (uint8_t)ip_parts[i];
+   return true;
 }
 
 
-   // Process the port part
-   pch = strtok(NULL, " ");
-   if (pch != NULL) {
-   if (!is_integer(pch, &fwQuery->qPort)) {
-       printf("Invalid port number\n");
-       free(fwQuery);
-       return NULL;
-   }    }
-   else {
-       printf("Invalid Query: Missing port\n");
-       free(fwQuery);
-       return NULL;
+// Parses "<ip> <port>" into fwQuery, for an IPv4 or IPv6 address
+bool process_query_cmd(const char* text, FwQuery* fwQuery)
+{
+   FwParseError err;
+   if (!parse_query(text, fwQuery, &err)) {
+       printf("Invalid query at column %zu: %s\n", err.pos + 1, err.what);
+       return false;
    }
-
-
-   return fwQuery;
+   return true;
 }
 
 
@@ -353,276 +259,430 @@ bool isValidQueryPort(FwQuery* fwQuery)
 }
 
 
-bool add_query_to_rule(FwRule* fwRule, FwQuery* fwQuery, FwQuery** fwqHead)
+// Checks the matching rules in table order and records the query under
+// the first one that does not have it yet; false if there is none. Only
+// recording the query takes a lock, the one of that rule's stripe. The
+// flow cache lets a repeated check skip the rules already holding it.
+bool check_query(const RuleSet* rs, uint32_t ip, uint16_t port)
 {
-   if (*fwqHead == NULL)
-   {
-       *fwqHead = fwQuery;
-       fwRule->qHead = *fwqHead;
-       return true;
+   uint64_t key = query_key(ip, port);
+   size_t cached;
+   bool hit = flow_cache_lookup(key, rs->generation, &cached);
+   size_t pos = cached;
+   bool matched = false;
+   while (!matched && pos < rs->table.count &&
+          (pos = rule_set_match(rs, ip, port, pos)) < rs->table.count) {
+       FwRule* currRule = rs->table.cold[pos];
+       pthread_mutex_t* queryLock = query_lock_for(currRule);
+       uint64_t held = stats_lock(queryLock, STAT_QUERY_WAIT);
+       matched = query_set_add(&currRule->queries, key);
+       stats_unlock(queryLock, STAT_QUERY_HOLD, held);
+       pos++;
+   }
+   if (!hit || pos != cached) {
+       flow_cache_store(key, rs->generation, pos);
    }
-   FwQuery* cur = *fwqHead;
+   stats_count(matched ? STAT_CHECK_ACCEPTED : STAT_CHECK_REJECTED, 1);
+   return matched;
+}
 
 
-   while (cur != NULL)
-   {
-       // Check if the query is already in the rule
-       if (strcmp(cur->RawCmd, fwQuery->RawCmd) == 0)
-       {
-           return false;
-       }
-       if (cur->pNext == NULL)
-       {
-           break;
-       }
-       cur = cur->pNext;
+// The IPv6 form of check_query(); these checks skip the flow cache
+bool check_query6(const RuleSet* rs, FwAddr6 ip, uint16_t port)
+{
+   const RuleTable6* table6 = rs->table6;
+   size_t pos = 0;
+   bool matched = false;
+   while (!matched && (pos = rule_table6_match(table6, ip, port, pos)) < table6->count) {
+       FwRule* currRule = table6->cold[pos];
+       pthread_mutex_t* queryLock = query_lock_for(currRule);
+       uint64_t held = stats_lock(queryLock, STAT_QUERY_WAIT);
+       matched = query_set_add6(&currRule->queries, ip.hi, ip.lo, port);
+       stats_unlock(queryLock, STAT_QUERY_HOLD, held);
+       pos++;
    }
-   cur->pNext = fwQuery;
-   return true;
+   stats_count(matched ? STAT_CHECK_ACCEPTED : STAT_CHECK_REJECTED, 1);
+   return matched;
 }
 
 
-FwRequest* process_cmd(char* buffer)
+void process_checks(const uint8_t* entries, uint32_t count, uint8_t* bitmap)
 {
-   FwRequest* fwReq = (FwRequest*)malloc(sizeof(FwRequest));
-   strcpy(fwReq->RawCmd, buffer);
-   fwReq->Cmd = buffer[0];
-   fwReq->pNext = NULL;
-   return fwReq;
+   memset(bitmap, 0, (count + 7) / 8);
+   // One version answers the whole frame
+   const RuleSet* rs = rule_set_acquire();
+   for (uint32_t i = 0; i < count; i++) {
+       const uint8_t* entry = entries + (size_t)i * FW_CHECK_ENTRY;
+       if (check_query(rs, proto_get32(entry), proto_get16(entry + 4))) {
+           bitmap[i / 8] |= (uint8_t)(1 << (i % 8));
+       }
+   }
+   rule_set_release();
 }
 
 
-char* process_request(char* buffer)
+// Resolves the file argument of B or W against the file set on the command
+// line: none means that file and a bare name means a file beside it. Paths
+// elsewhere are refused, since any client may send these commands.
+static bool admin_path(const char* file, const char* name, char* path, size_t size)
 {
-   FwRequest* fwReq = process_cmd(buffer);
+   if (*name == '\0') {
+       return snprintf(path, size, "%s", file) < (int)size;
+   }
+   if (strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+       return false;
+   }
+   const char* slash = strrchr(file, '/');
+   int dirLen = slash != NULL ? (int)(slash - file) + 1 : 0;
+   return snprintf(path, size, "%.*s%s", dirLen, file, name) < (int)size;
+}
 
 
-   // Allocate response buffer
-   char *response = malloc(1024 * sizeof(char)); // make sure to free it after use
-   if (!response) {
-       perror("Failed to allocate response buffer");
-       exit(1);
+// Appends the rules of one family and their queries to the listing
+static void list_rules(FwRule* const* rules, size_t count, FwBuf* out)
+{
+   for (size_t pos = 0; pos < count; pos++) {
+       FwRule* currRule = rules[pos];
+       buf_puts(out, "Rule: ");
+       buf_puts(out, currRule->RawCmd);
+       buf_append(out, "\n", 1);
+       pthread_mutex_t* queryLock = query_lock_for(currRule);
+       uint64_t held = stats_lock(queryLock, STAT_QUERY_WAIT);
+       // For each query
+       for (size_t q = 0; q < currRule->queries.count; q++) {
+           if (currRule->ipv6) {
+               const uint64_t* key = currRule->queries.keys + q * QUERY6_WORDS;
+               uint8_t ip[16];
+               char text[INET6_ADDRSTRLEN];
+               for (int i = 0; i < 8; i++) {
+                   ip[i] = (uint8_t)(key[0] >> (56 - 8 * i));
+                   ip[i + 8] = (uint8_t)(key[1] >> (56 - 8 * i));
+               }
+               inet_ntop(AF_INET6, ip, text, sizeof(text));
+               buf_printf(out, "Query: %s %d\n", text, (int)key[2]);
+           } else {
+               uint64_t key = currRule->queries.keys[q];
+               uint32_t qip = query_key_ip(key);
+               buf_printf(out, "Query: %u.%u.%u.%u %d\n",
+                          qip >> 24, (qip >> 16) & 255, (qip >> 8) & 255, qip & 255, query_key_port(key));
+           }
+       }
+       stats_unlock(queryLock, STAT_QUERY_HOLD, held);
    }
-   bzero(response, 1024);
+}
+
+
+// Appends one history line to the response
+bool emit_history(const char* rawCmd, void* arg)
+{
+   FwBuf* out = arg;
+   buf_puts(out, rawCmd);
+   buf_append(out, "\n", 1);
+   return true;
+}
 
 
+void process_request(char* buffer, FwBuf* out)
+{
    // Lock mutex before modifying shared data
-   pthread_mutex_lock(&lock);
-   add_to_Req_list(fwReq, &fwReqHead);
-   pthread_mutex_unlock(&lock);
+   uint64_t held = stats_lock(&history_lock, STAT_HISTORY_WAIT);
+   req_log_append(buffer);
+   stats_unlock(&history_lock, STAT_HISTORY_HOLD, held);
 
 
-   switch (fwReq->Cmd)
+   switch (buffer[0])
    {
    case 'A':
-       pthread_mutex_lock(&lock);
        {
-           char tempBuffer[256];
-           strcpy(tempBuffer, buffer + 2); // Skip 'A '
-           FwRule* fwRule = process_rule_cmd(tempBuffer);
-           if (fwRule != NULL && isValidRule(fwRule)){
-               add_to_rule_list(fwRule, &fwRuleHead);
-               strcpy(response, "Rule added");
+           FwRule fwRule;
+           if (!process_rule_cmd(cmd_args(buffer), &fwRule) || !isValidRule(&fwRule)){
+               buf_puts(out, "Invalid rule");
+           }
+           else if (rule_set_add(&fwRule)){
+               buf_puts(out, "Rule added");
            }
            else{
-               strcpy(response, "Invalid rule");
-               if (fwRule != NULL)
-                   free(fwRule);
+               buf_puts(out, "Rule already exists");
            }
        }
-       pthread_mutex_unlock(&lock);
        break;
    case 'D':
-       pthread_mutex_lock(&lock);
        {
-           char tempBuffer[256];
-           strcpy(tempBuffer, buffer + 2); // Skip 'D '
-           FwRule* fwRuleToDelete = process_rule_cmd(tempBuffer);
-           if (fwRuleToDelete == NULL || !isValidRule(fwRuleToDelete)) {
-               strcpy(response, "Rule invalid");
-               if (fwRuleToDelete != NULL)
-                   free(fwRuleToDelete);
+           FwRule fwRuleToDelete;
+           if (!process_rule_cmd(cmd_args(buffer), &fwRuleToDelete) || !isValidRule(&fwRuleToDelete)) {
+               buf_puts(out, "Rule invalid");
            } else {
-               // Search for the rule in fwRuleHead
-               FwRule *prev = NULL, *curr = fwRuleHead;
-               bool found = false;
-               while (curr != NULL) {
-                   if (strcmp(curr->RawCmd, fwRuleToDelete->RawCmd) == 0) {
-                       // Found the rule
-                       if (prev == NULL) {
-                           fwRuleHead = curr->pNext;
-                       } else {
-                           prev->pNext = curr->pNext;
-                       }
-                       // Free the rule and its queries
-                       FwQuery* qcurr = curr->qHead;
-                       while (qcurr != NULL) {
-                           FwQuery* qnext = qcurr->pNext;
-                           free(qcurr);
-                           qcurr = qnext;
-                       }
-                       free(curr);
-                       strcpy(response, "Rule deleted");
-                       found = true;
-                       break;
-                   }
-                   prev = curr;
-                   curr = curr->pNext;
-               }
-               if (!found) {
-                   strcpy(response, "Rule not found");
+               // Matched on the parsed bounds, not the text. The rule and
+               // its queries are freed once no check uses them.
+               if (rule_set_delete(&fwRuleToDelete)) {
+                   buf_puts(out, "Rule deleted");
+               } else {
+                   buf_puts(out, "Rule not found");
                }
-               free(fwRuleToDelete);
            }
        }
-       pthread_mutex_unlock(&lock);
        break;
    case 'L':
-       pthread_mutex_lock(&lock);
        {
-           FwRule* currRule = fwRuleHead;
-           response[0] = '\0'; // reset response
-           while (currRule != NULL) {
-               char ruleLine[512];
-               snprintf(ruleLine, 512, "Rule: %s\n", currRule->RawCmd);
-               strcat(response, ruleLine);
-               // For each query
-               FwQuery* currQuery = currRule->qHead;
-               while (currQuery != NULL) {
-                   char queryLine[512];
-                   snprintf(queryLine, 512, "Query: %hhu.%hhu.%hhu.%hhu %d\n",
-                            currQuery->qiP[0], currQuery->qiP[1], currQuery->qiP[2], currQuery->qiP[3], currQuery->qPort);
-                   strcat(response, queryLine);
-                   currQuery = currQuery->pNext;
-               }
-               currRule = currRule->pNext;
-           }
-           if (strlen(response) == 0) {
-               strcpy(response, "No rules");
+           // The listing is only built here; the engine writes it out
+           // after every lock has been dropped. Each rule's queries are
+           // copied under its own stripe, so checks wait for one rule at
+           // most. IPv4 rules come first, then IPv6 ones.
+           size_t start = out->len;
+           const RuleSet* rs = rule_set_acquire();
+           list_rules(rs->table.cold, rs->table.count, out);
+           list_rules(rs->table6->cold, rs->table6->count, out);
+           rule_set_release();
+           if (out->len == start) {
+               buf_puts(out, "No rules");
            }
        }
-       pthread_mutex_unlock(&lock);
        break;
    case 'R':
-       pthread_mutex_lock(&lock);
        {
-           FwRequest* currReq = fwReqHead;
-           response[0] = '\0'; // reset response
-           while (currReq != NULL) {
-               strcat(response, currReq->RawCmd);
-               strcat(response, "\n");
-               currReq = currReq->pNext;
+           // "R" lists the history still in memory; "R <first> [<count>]"
+           // pages from command number first, reaching back into the
+           // history log when one is kept. Any other text after the R is
+           // ignored, as it always was.
+           unsigned long long first = 0;
+           size_t count = (size_t)-1;
+           int end = 0;
+           if (buffer[1] != ' ' ||
+               sscanf(buffer + 2, "%llu %n%zu %n", &first, &end, &count, &end) < 1 ||
+               buffer[2 + end] != '\0') {
+               first = 0;
+               count = (size_t)-1;
+           }
+           // Copied a chunk at a time, so the commands of other clients
+           // only wait for one chunk, and commands only in the history log
+           // are read from it after the lock is dropped. Commands past the
+           // ones already recorded when R arrived are left for the next R.
+           size_t start = out->len;
+           held = stats_lock(&history_lock, STAT_HISTORY_WAIT);
+           uint64_t total = req_log_count();
+           if (first == 0) {
+               first = total > (uint64_t)historySize ? total - historySize + 1 : 1;
+           }
+           if (first > total) {
+               count = 0;
+           } else if (count > total - first + 1) {
+               count = total - first + 1;
+           }
+           while (true) {
+               size_t chunk = count < HISTORY_CHUNK ? count : HISTORY_CHUNK;
+               ReqLogSpill span;
+               if (req_log_spill_span(first, chunk, &span)) {
+                   stats_unlock(&history_lock, STAT_HISTORY_HOLD, held);
+                   req_log_read_spill(&span, emit_history, out);
+                   chunk = span.to - span.from;
+               } else {
+                   req_log_read(first, chunk, emit_history, out);
+                   stats_unlock(&history_lock, STAT_HISTORY_HOLD, held);
+               }
+               count -= chunk;
+               first += chunk;
+               if (count == 0) {
+                   break;
+               }
+               held = stats_lock(&history_lock, STAT_HISTORY_WAIT);
            }
-           if (strlen(response) == 0) {
-               strcpy(response, "No requests");
+           if (out->len == start) {
+               buf_puts(out, "No requests");
            }
        }
-       pthread_mutex_unlock(&lock);
-       break; // Add this break
+       break;
 
 
    case 'C':
-       pthread_mutex_lock(&lock);
        {
-           char tempBuffer[256];
-           strcpy(tempBuffer, buffer + 2); // Skip 'C '
-           FwQuery* fwQuery = process_query_cmd(tempBuffer);
-           if (fwQuery == NULL || !isValidQueryIP(fwQuery) || !isValidQueryPort(fwQuery)) {
-               strcpy(response, "Illegal IP address or port specified");
-               if (fwQuery != NULL)
-                   free(fwQuery);
+           FwQuery fwQuery;
+           if (!process_query_cmd(cmd_args(buffer), &fwQuery) || !isValidQueryIP(&fwQuery) || !isValidQueryPort(&fwQuery)) {
+               buf_puts(out, "Illegal IP address or port specified");
            } else {
-               // Check if the IP and port match any rule
-               FwRule* currRule = fwRuleHead;
-               bool matched = false;
-               while (currRule != NULL) {
-                   // Check if the IP and port are within the rule's ranges
-                   bool ipMatches = true;
-                   for (int i = 0; i < 4; i++) {
-                       if (fwQuery->qiP[i] < currRule->ip1[i] || fwQuery->qiP[i] > currRule->ip2[i]) {
-                           ipMatches = false;
-                           break;
-                       }
-                   }
-                   if (ipMatches && fwQuery->qPort >= currRule->port1 && fwQuery->qPort <= currRule->port2) {
-                       // Check if the query is already in the rule
-                       FwQuery* qcur = currRule->qHead;
-                       bool alreadyInRule = false;
-                       while (qcur != NULL) {
-                           if (strcmp(qcur->RawCmd, fwQuery->RawCmd) == 0) {
-                               alreadyInRule = true;
-                               break;
-                           }
-                           qcur = qcur->pNext;
-                       }
-                       if (!alreadyInRule) {
-                           // Query not in this rule, add it
-                           add_query_to_rule(currRule, fwQuery, &(currRule->qHead));
-                           matched = true;
-                           break; // Only add to one rule
-                       }
-                   }
-                   currRule = currRule->pNext;
-               }
+               const RuleSet* rs = rule_set_acquire();
+               bool matched = fwQuery.ipv6
+                   ? check_query6(rs, pack_ip6(fwQuery.qiP6), (uint16_t)fwQuery.qPort)
+                   : check_query(rs, pack_ip(fwQuery.qiP), (uint16_t)fwQuery.qPort);
+               rule_set_release();
                if (matched) {
-                   strcpy(response, "Connection accepted");
+                   buf_puts(out, "Connection accepted");
                } else {
-                   strcpy(response, "Connection rejected");
-                   free(fwQuery);
+                   buf_puts(out, "Connection rejected");
                }
            }
        }
-       pthread_mutex_unlock(&lock);
        break;
 
 
-   default:
-       strcpy(response, "Illegal request");
+   case 'B':
+       {
+           // Admin bulk load: "B [name]" appends every rule in the -r file
+           // or in the named file beside it
+           char path[PATH_MAX];
+           RuleLoadResult loaded;
+           if (ruleFile == NULL) {
+               buf_puts(out, "No rule file");
+           } else if (!admin_path(ruleFile, cmd_args(buffer), path, sizeof(path))) {
+               buf_puts(out, "Illegal rule file name");
+           } else if (!rule_load_file(path, loadThreads, &loaded)) {
+               buf_puts(out, "Cannot read rule file");
+           } else {
+               buf_printf(out, "Rules loaded: %zu, duplicates: %zu, invalid lines: %zu",
+                          loaded.added, loaded.duplicates, loaded.invalid);
+           }
+       }
+       break;
+
+
+   case 'W':
+       {
+           // "W [name]" snapshots the rules in the background to the -s file
+           // or to the named file beside it
+           char path[PATH_MAX];
+           if (snapshotFile == NULL) {
+               buf_puts(out, "No snapshot file");
+           } else if (!admin_path(snapshotFile, cmd_args(buffer), path, sizeof(path))) {
+               buf_puts(out, "Illegal snapshot name");
+           } else if (snapshot_start(path)) {
+               buf_puts(out, "Snapshot started");
+           } else {
+               buf_puts(out, "Snapshot already in progress");
+           }
+       }
        break;
-   }
 
 
-   return response;
+   case 'S':
+       {
+           size_t start = out->len;
+           PoolCounters pool;
+           if (pool_get_counters(&pool)) {
+               buf_printf(out, "Pool: %d workers, %d busy, %zu/%zu queued\n",
+                          pool.workers, pool.busy, pool.queued, pool.capacity);
+           }
+           // A few KB, well within any engine's thread stack
+           LoopCounters loops;
+           if (epoll_get_counters(&loops)) {
+               buf_printf(out, "%s: %d, accepted", loops.reusePort ? "Listeners" : "Loops",
+                          loops.loops);
+               for (int i = 0; i < loops.loops; i++) {
+                   buf_printf(out, " %llu", (unsigned long long)loops.accepted[i]);
+                   if (loops.cpus[i] >= 0) {
+                       buf_printf(out, " (cpu %d)", loops.cpus[i]);
+                   }
+               }
+               buf_puts(out, "\n");
+           }
+           UringCounters uring;
+           if (uring_get_counters(&uring)) {
+               buf_printf(out, "io_uring: %d rings, %llu enters for %llu completions (%.2f per completion), %s buffers\n",
+                          uring.rings, (unsigned long long)uring.enters,
+                          (unsigned long long)uring.completions,
+                          uring.completions ? (double)uring.enters / uring.completions : 0.0,
+                          uring.registered ? "registered" : "unregistered");
+           }
+           FlowCacheCounters flows;
+           flow_cache_get_counters(&flows);
+           uint64_t lookups = flows.hits + flows.misses;
+           buf_printf(out, "Flow cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+                      (unsigned long long)flows.hits, (unsigned long long)flows.misses,
+                      lookups ? 100.0 * flows.hits / lookups : 0.0);
+           const RuleSet* rs = rule_set_acquire();
+           size_t rules6 = rs->table6->count;
+           buf_printf(out, "Rules: %zu IPv4, %zu IPv6 (%zu bytes per IPv6 rule, not counting queries)\n",
+                      rs->table.count, rules6, rules6 ? rule_table6_bytes(rs->table6) / rules6 : 0);
+           // Small tables are scanned without an index
+           if (rs->indexed) {
+               buf_printf(out, "IPv4 index: %zu segments, %zu list entries, %zu bytes\n",
+                          rs->index.nseg, rs->index.offsets[rs->index.nseg], rule_index_bytes(&rs->index));
+           }
+           rule_set_release();
+           stats_report(out);
+           // No newline after the last line
+           if (out->len > start && out->data[out->len - 1] == '\n') {
+               out->len--;
+           }
+       }
+       break;
+
+   default:
+       buf_puts(out, "Illegal request");
+       break;
+   }
 }
 void handle_sigint(int sig) {
    printf("Caught signal %d, shutting down server...\n", sig);
+   // An io_uring accept still holds the listener after close, until the
+   // ring is torn down; shutdown frees the port straight away. The other
+   // engines' accept loops would spin on the shut socket until exit.
+   UringCounters uring;
+   if (uring_get_counters(&uring)) {
+       shutdown(server_sockfd, SHUT_RDWR);
+   }
    close(server_sockfd);
-   pthread_mutex_destroy(&lock);
+   pthread_mutex_destroy(&history_lock);
    exit(0);
 }
 
 
 
 
-void *client_handler(void *arg) {
-   int newsockfd = *((int *)arg);
-   free(arg);
-   char buffer[256];
-   bzero(buffer,256);
-   int n;
-
-
-   // Read command from client
-   n = read(newsockfd,buffer,255);
-   if (n < 0) {
-       perror("ERROR reading from socket");
-       close(newsockfd);
-       pthread_exit(NULL);
+// Writes all len bytes, retrying short writes
+bool write_all(int fd, const char* data, size_t len)
+{
+   while (len > 0) {
+       ssize_t n = write(fd, data, len);
+       if (n < 0) {
+           return false;
+       }
+       data += n;
+       len -= n;
    }
-   buffer[n] = '\0'; // Null-terminate the buffer
-
+   return true;
+}
 
-   // Process the command
-   char* response = process_request(buffer);
 
+void serve_connection(int sockfd, FwConn* conn)
+{
+   conn_reset(conn);
+
+   while (!conn->closing) {
+       // Commands held back until the last responses were written run
+       // before anything more is read
+       bool eof = false;
+       if (!conn->paused) {
+           char* dst = buf_reserve(&conn->in, 4096);
+           ssize_t n = read(sockfd, dst, 4096);
+           if (n < 0) {
+               perror("ERROR reading from socket");
+               break;
+           }
+           conn->in.len += n;
+           eof = n == 0;
+       }
+       conn_process(conn, eof);
 
-   // Send response to client
-   n = write(newsockfd, response, strlen(response));
-   if (n < 0) {
-       perror("ERROR writing to socket");
+       // Responses go out as soon as the commands that were read have run
+       if (conn->out.len > 0) {
+           if (!write_all(sockfd, conn->out.data, conn->out.len)) {
+               perror("ERROR writing to socket");
+               break;
+           }
+           conn->out.len = 0;
+       }
    }
-   free(response);
-   close(newsockfd);
+   close(sockfd);
+   stats_count(STAT_CONN_CLOSED, 1);
+}
+
+
+void *client_handler(void *arg) {
+   int newsockfd = *((int *)arg);
+   free(arg);
+   FwConn conn;
+   conn_init(&conn);
+   serve_connection(newsockfd, &conn);
+   conn_free(&conn);
    pthread_exit(NULL);
 }
 
@@ -631,6 +691,8 @@ void run_interactive(CmdArg* pcmd)
 {
    printf("running interactive\n");
    char buffer[255];
+   FwBuf out;
+   buf_init(&out);
 
 
    while (true)
@@ -640,24 +702,29 @@ void run_interactive(CmdArg* pcmd)
        buffer[strcspn(buffer, "\n")] = 0;
 
 
-       char* response = process_request(buffer);
-       printf("%s\n", response);
-       free(response);
+       process_request(buffer, &out);
+       fwrite(out.data, 1, out.len, stdout);
+       printf("\n");
+       out.len = 0;
    }
 }
 
 
-void run_listen(CmdArg* pcmd)
+// Opens a TCP socket listening on port, or exits
+int open_listener(int port, int backlog, bool reusePort)
 {
-   printf("running listen on port %d\n", pcmd->port);
-   int sockfd, newsockfd, portno;
-   socklen_t clilen;
-   struct sockaddr_in serv_addr, cli_addr;
-   pthread_t thread_id;
+   int sockfd;
+   struct sockaddr_in serv_addr;
+   struct sockaddr_in6 serv_addr6;
 
 
-   // Create socket
-   sockfd = socket(AF_INET, SOCK_STREAM, 0);
+   // Create socket, dual-stack where the host has IPv6
+   bool ipv6 = true;
+   sockfd = socket(AF_INET6, SOCK_STREAM, 0);
+   if (sockfd < 0) {
+      ipv6 = false;
+      sockfd = socket(AF_INET, SOCK_STREAM, 0);
+   }
    if (sockfd < 0) {
       perror("ERROR opening socket");
       exit(1);
@@ -667,22 +734,59 @@ void run_listen(CmdArg* pcmd)
        perror("setsockopt(SO_REUSEADDR) failed");
        exit(1);
    }
+   if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+       perror("setsockopt(SO_REUSEPORT) failed");
+       exit(1);
+   }
+   // IPv4 clients arrive as IPv4-mapped addresses
+   int v6only = 0;
+   if (ipv6 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+       perror("setsockopt(IPV6_V6ONLY) failed");
+       exit(1);
+   }
 
 
    // Bind socket to port
-   bzero((char *) &serv_addr, sizeof(serv_addr));
-   portno = pcmd->port;
-   serv_addr.sin_family = AF_INET;
-   serv_addr.sin_addr.s_addr = INADDR_ANY;
-   serv_addr.sin_port = htons(portno);
-   if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+   int bound;
+   if (ipv6) {
+       bzero((char *) &serv_addr6, sizeof(serv_addr6));
+       serv_addr6.sin6_family = AF_INET6;
+       serv_addr6.sin6_addr = in6addr_any;
+       serv_addr6.sin6_port = htons(port);
+       bound = bind(sockfd, (struct sockaddr *) &serv_addr6, sizeof(serv_addr6));
+   } else {
+       bzero((char *) &serv_addr, sizeof(serv_addr));
+       serv_addr.sin_family = AF_INET;
+       serv_addr.sin_addr.s_addr = INADDR_ANY;
+       serv_addr.sin_port = htons(port);
+       bound = bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+   }
+   if (bound < 0) {
             perror("ERROR on binding");
             exit(1);
    }
 
 
    // Listen
-   listen(sockfd,5);
+   if (listen(sockfd, backlog) < 0) {
+       perror("ERROR on listen");
+       exit(1);
+   }
+   server_sockfd = sockfd;
+   return sockfd;
+}
+
+
+void run_listen(CmdArg* pcmd)
+{
+   printf("running listen on port %d\n", pcmd->port);
+   int sockfd, newsockfd;
+   socklen_t clilen;
+   struct sockaddr_storage cli_addr;
+   pthread_t thread_id;
+
+
+   sockfd = open_listener(pcmd->port, pcmd->backlog, false);
    clilen = sizeof(cli_addr);
 
 
@@ -695,6 +799,7 @@ void run_listen(CmdArg* pcmd)
             perror("ERROR on accept");
             continue;
        }
+       stats_count(STAT_CONN_ACCEPTED, 1);
        // Create a new thread to handle the client
        int *pclient = malloc(sizeof(int));
        *pclient = newsockfd;
@@ -710,29 +815,87 @@ void run_listen(CmdArg* pcmd)
 }
 
 
+// Sets up the shared state every engine works on
+void server_init(int history, const char* historyLog)
+{
+   pthread_mutex_init(&history_lock, NULL);
+   for (int i = 0; i < QUERY_LOCK_STRIPES; i++) {
+       pthread_mutex_init(&queryLocks[i].mutex, NULL);
+   }
+   rule_set_init();
+   historySize = history;
+   req_log_init(historySize, historyLog);
+}
+
+
+// The benchmarks link this file without its main
+#ifndef FW_NO_MAIN
 int main(int argc, char** argv)
 {
    CmdArg cmdArg;
    if (!process_args(argc, argv, &cmdArg)){
        printf("Invalid arguments\n");
+       print_usage(argv[0]);
        return 1;
    }
    signal(SIGINT, handle_sigint);
    signal(SIGTERM, handle_sigint);
+   // A client closing early must not kill the server mid-write
+   signal(SIGPIPE, SIG_IGN);
+
+
+   server_init(cmdArg.history, cmdArg.history_log);
+   loadThreads = cmdArg.threads;
+   snapshotFile = cmdArg.snapshot_file;
+   ruleFile = cmdArg.rule_file;
+   if (snapshotFile != NULL && access(snapshotFile, F_OK) == 0) {
+       size_t rules, queries;
+       const char* error;
+       if (!snapshot_load(snapshotFile, &rules, &queries, &error)) {
+           printf("ERROR loading snapshot %s: %s\n", snapshotFile, error);
+           return 1;
+       }
+       printf("restored %zu rules and %zu queries from %s\n", rules, queries, snapshotFile);
+   }
+   if (cmdArg.rule_file != NULL) {
+       RuleLoadResult loaded;
+       if (!rule_load_file(cmdArg.rule_file, loadThreads, &loaded)) {
+           perror("ERROR loading rule file");
+           return 1;
+       }
+       printf("loaded %zu rules from %s\n", loaded.added, cmdArg.rule_file);
+       if (loaded.duplicates > 0) {
+           printf("skipped %zu duplicate rules\n", loaded.duplicates);
+       }
+       if (loaded.invalid > 0) {
+           printf("skipped %zu invalid lines, the first on line %zu\n", loaded.invalid, loaded.firstInvalid);
+       }
+   }
 
-
-   pthread_mutex_init(&lock, NULL);
+   if (cmdArg.stats_file != NULL) {
+       stats_start_dump(cmdArg.stats_file, STATS_DUMP_SECONDS);
+   }
 
 
    if (cmdArg.is_interactive){
        run_interactive(&cmdArg);
+   } else if (cmdArg.engine == ENGINE_EPOLL || cmdArg.engine == ENGINE_REUSEPORT) {
+       run_epoll(&cmdArg);
+   } else if (cmdArg.engine == ENGINE_POOL) {
+       run_pool(&cmdArg);
+   } else if (cmdArg.engine == ENGINE_URING) {
+       if (!run_uring(&cmdArg)) {
+           printf("falling back to one thread per connection\n");
+           run_listen(&cmdArg);
+       }
    } else {
        run_listen(&cmdArg);
    }
 
 
-   pthread_mutex_destroy(&lock);
+   pthread_mutex_destroy(&history_lock);
 
 
    return 0;
 }
+#endif
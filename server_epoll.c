@@ -0,0 +1,341 @@
+#define _GNU_SOURCE     // pthread_setaffinity_np
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server_helper.h"
+#include "conn.h"
+#include "stats.h"
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+
+#define MAX_EVENTS 256
+// Bytes read from one connection per wakeup, so a busy client cannot
+// starve the others on its loop
+#define READ_BUDGET 65536
+
+
+typedef struct EpollConn
+{
+   int fd;
+   size_t outSent;    // bytes of conn.out already written
+   uint32_t events;   // currently registered epoll events
+   FwConn conn;
+} EpollConn;
+
+
+typedef struct EpollLoop
+{
+   int epfd;
+   int listenfd;
+   int cpu;                         // CPU the loop is pinned to, or -1
+   atomic_uint_least64_t accepted;  // written by the loop only
+   pthread_t thread;
+} EpollLoop;
+
+
+static EpollLoop* allLoops = NULL;
+static int loopCount = 0;
+static bool loopsReusePort = false;
+
+
+static bool set_nonblocking(int fd)
+{
+   int flags = fcntl(fd, F_GETFL, 0);
+   return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+static void close_conn(EpollLoop* loop, EpollConn* ec)
+{
+   epoll_ctl(loop->epfd, EPOLL_CTL_DEL, ec->fd, NULL);
+   close(ec->fd);
+   conn_free(&ec->conn);
+   free(ec);
+   stats_count(STAT_CONN_CLOSED, 1);
+}
+
+
+// Writes as much pending output as the socket takes. Returns false when
+// the connection is finished or broken and has been closed.
+static bool flush_conn(EpollLoop* loop, EpollConn* ec)
+{
+   FwBuf* out = &ec->conn.out;
+   while (true) {
+       while (ec->outSent < out->len) {
+           ssize_t n = write(ec->fd, out->data + ec->outSent, out->len - ec->outSent);
+           if (n < 0) {
+               if (errno == EINTR) {
+                   continue;
+               }
+               if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                   break;
+               }
+               close_conn(loop, ec);
+               return false;
+           }
+           ec->outSent += n;
+       }
+       if (ec->outSent < out->len) {
+           break;
+       }
+       out->len = 0;
+       ec->outSent = 0;
+       if (ec->conn.closing) {
+           close_conn(loop, ec);
+           return false;
+       }
+       // Run the commands held back while out was full
+       if (!ec->conn.paused) {
+           break;
+       }
+       conn_process(&ec->conn, false);
+   }
+
+   // Only ask for EPOLLOUT while output is backed up, and stop reading
+   // from a connection whose commands are paused or that is just draining
+   // its last response
+   bool reading = !ec->conn.closing && !ec->conn.paused;
+   uint32_t events = (reading ? EPOLLIN : 0) | (out->len > 0 ? EPOLLOUT : 0);
+   if (events != ec->events) {
+       struct epoll_event ev;
+       ev.events = events;
+       ev.data.ptr = ec;
+       epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ec->fd, &ev);
+       ec->events = events;
+   }
+   return true;
+}
+
+
+static void handle_readable(EpollLoop* loop, EpollConn* ec)
+{
+   bool eof = false;
+   size_t budget = READ_BUDGET;
+   while (budget > 0 && !ec->conn.closing && !ec->conn.paused) {
+       char* dst = buf_reserve(&ec->conn.in, 4096);
+       ssize_t n = read(ec->fd, dst, 4096);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           if (errno == EAGAIN || errno == EWOULDBLOCK) {
+               break;
+           }
+           close_conn(loop, ec);
+           return;
+       }
+       if (n == 0) {
+           eof = true;
+           break;
+       }
+       ec->conn.in.len += n;
+       budget = (size_t)n >= budget ? 0 : budget - n;
+   }
+
+   conn_process(&ec->conn, eof);
+   flush_conn(loop, ec);
+}
+
+
+static void accept_clients(EpollLoop* loop)
+{
+   while (true) {
+       int fd = accept(loop->listenfd, NULL, NULL);
+       if (fd < 0) {
+           if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+               perror("ERROR on accept");
+           }
+           return;
+       }
+       if (!set_nonblocking(fd)) {
+           close(fd);
+           continue;
+       }
+       EpollConn* ec = malloc(sizeof(EpollConn));
+       if (ec == NULL) {
+           close(fd);
+           continue;
+       }
+       ec->fd = fd;
+       ec->outSent = 0;
+       ec->events = EPOLLIN;
+       conn_init(&ec->conn);
+
+       struct epoll_event ev;
+       ev.events = EPOLLIN;
+       ev.data.ptr = ec;
+       if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+           perror("ERROR adding connection to epoll");
+           close(fd);
+           conn_free(&ec->conn);
+           free(ec);
+           continue;
+       }
+       stats_count(STAT_CONN_ACCEPTED, 1);
+       atomic_store_explicit(&loop->accepted,
+                             atomic_load_explicit(&loop->accepted, memory_order_relaxed) + 1,
+                             memory_order_relaxed);
+   }
+}
+
+
+static void* epoll_loop(void* arg)
+{
+   EpollLoop* loop = arg;
+   struct epoll_event events[MAX_EVENTS];
+
+   if (loop->cpu >= 0) {
+       cpu_set_t set;
+       CPU_ZERO(&set);
+       CPU_SET(loop->cpu, &set);
+       int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+       if (err != 0) {
+           fprintf(stderr, "WARNING could not pin loop to cpu %d: %s\n", loop->cpu, strerror(err));
+       }
+   }
+
+   while (true) {
+       int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           perror("ERROR in epoll_wait");
+           exit(1);
+       }
+       for (int i = 0; i < n; i++) {
+           EpollConn* ec = events[i].data.ptr;
+           if (ec == NULL) {
+               accept_clients(loop);
+           } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+               handle_readable(loop, ec);
+           } else if (events[i].events & EPOLLOUT) {
+               flush_conn(loop, ec);
+           }
+       }
+   }
+   return NULL;
+}
+
+
+bool epoll_get_counters(LoopCounters* counters)
+{
+   if (loopCount == 0) {
+       return false;
+   }
+   counters->loops = loopCount < MAX_LOOPS ? loopCount : MAX_LOOPS;
+   counters->reusePort = loopsReusePort;
+   for (int i = 0; i < counters->loops; i++) {
+       counters->cpus[i] = allLoops[i].cpu;
+       counters->accepted[i] = atomic_load_explicit(&allLoops[i].accepted, memory_order_relaxed);
+   }
+   return true;
+}
+
+
+// The n-th CPU this process may run on, counting round the allowed set,
+// or -1 when the set cannot be read
+static int nth_allowed_cpu(int n)
+{
+   cpu_set_t set;
+   if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0) {
+       return -1;
+   }
+   n %= CPU_COUNT(&set);
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+       if (CPU_ISSET(cpu, &set) && n-- == 0) {
+           return cpu;
+       }
+   }
+   return -1;
+}
+
+
+static void watch_listener(EpollLoop* loop, bool exclusive)
+{
+   if (!set_nonblocking(loop->listenfd)) {
+       perror("ERROR making listener non-blocking");
+       exit(1);
+   }
+   struct epoll_event ev;
+   ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+   if (exclusive) {
+       ev.events |= EPOLLEXCLUSIVE;
+   }
+#endif
+   ev.data.ptr = NULL;
+   if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) < 0) {
+       perror("ERROR adding listener to epoll");
+       exit(1);
+   }
+}
+
+
+void run_epoll(CmdArg* pcmd)
+{
+   bool reusePort = pcmd->engine == ENGINE_REUSEPORT;
+   printf("running %s on port %d with %d loops\n", reusePort ? "reuseport" : "epoll",
+          pcmd->port, pcmd->threads);
+
+   // Plain epoll: every loop watches one shared listener and
+   // EPOLLEXCLUSIVE wakes only one of them per incoming connection.
+   // Reuseport: each loop has a listener of its own, the kernel hashes
+   // each connection to one of them, and the loop that accepts it is
+   // pinned to its CPU.
+   EpollLoop* loops = calloc(pcmd->threads, sizeof(EpollLoop));
+   if (loops == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   int sharedfd = reusePort ? -1 : open_listener(pcmd->port, pcmd->backlog, false);
+   for (int i = 0; i < pcmd->threads; i++) {
+       loops[i].epfd = epoll_create1(0);
+       if (loops[i].epfd < 0) {
+           perror("ERROR creating epoll instance");
+           exit(1);
+       }
+       loops[i].listenfd = reusePort ? open_listener(pcmd->port, pcmd->backlog, true) : sharedfd;
+       loops[i].cpu = reusePort ? nth_allowed_cpu(i) : -1;
+       atomic_init(&loops[i].accepted, 0);
+       watch_listener(&loops[i], !reusePort);
+   }
+   allLoops = loops;
+   loopCount = pcmd->threads;
+   loopsReusePort = reusePort;
+
+   for (int i = 1; i < pcmd->threads; i++) {
+       if (pthread_create(&loops[i].thread, NULL, epoll_loop, &loops[i]) != 0) {
+           perror("Failed to create thread");
+           exit(1);
+       }
+   }
+   epoll_loop(&loops[0]);
+}
+
+#else
+
+void run_epoll(CmdArg* pcmd)
+{
+   printf("epoll and reuseport engines are only available on Linux\n");
+   exit(1);
+}
+
+
+bool epoll_get_counters(LoopCounters* counters)
+{
+   return false;
+}
+
+#endif
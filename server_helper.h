@@ -0,0 +1,213 @@
+#ifndef SERVER_HELPER_H
+#define SERVER_HELPER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "fw_buf.h"
+#include "query_set.h"
+
+
+#define MAX_FW_CMD 255
+#define QUERY_LOCK_STRIPES 64   // locks shared out among the rules' query sets
+#define HISTORY_CHUNK 256       // history entries R copies per lock hold
+#define MAX_LOOPS 256           // epoll loops S reports on
+
+
+typedef enum ServerEngine
+{
+   ENGINE_THREADS,   // one thread per connection
+   ENGINE_EPOLL,     // non-blocking sockets on a few epoll loops
+   ENGINE_POOL,      // fixed worker threads fed by a bounded queue
+   ENGINE_REUSEPORT, // epoll loops pinned to CPUs, each with its own
+                     // SO_REUSEPORT listener
+   ENGINE_URING      // io_uring rings, or ENGINE_THREADS without io_uring
+} ServerEngine;
+
+
+typedef struct CmdArg
+{
+   bool is_interactive;
+   int port;
+   ServerEngine engine;
+   int threads;      // event-loop or worker threads
+   int queue_depth;  // accepted sockets the pool may queue
+   int backlog;      // listen() backlog of each listening socket
+   int history;      // commands kept in memory for R
+   const char* history_log;  // file older commands spill to, or NULL
+   const char* rule_file;    // rules loaded before serving, or NULL
+   const char* snapshot_file;  // restored at startup, written by W
+   const char* stats_file;     // gets a stats report every STATS_DUMP_SECONDS
+} CmdArg;
+
+
+typedef struct PoolCounters
+{
+   int workers;
+   int busy;
+   size_t queued;
+   size_t capacity;
+} PoolCounters;
+
+
+// Connections each event loop has accepted
+typedef struct LoopCounters
+{
+   int loops;
+   bool reusePort;        // each loop has its own listener
+   int cpus[MAX_LOOPS];   // CPU each loop is pinned to, or -1
+   uint64_t accepted[MAX_LOOPS];
+} LoopCounters;
+
+
+// Work done by the io_uring rings
+typedef struct UringCounters
+{
+   int rings;
+   bool registered;         // reads use registered buffers
+   uint64_t enters;         // io_uring_enter calls
+   uint64_t completions;
+} UringCounters;
+
+
+typedef struct FwRequest
+{
+   char RawCmd[MAX_FW_CMD];
+   char Cmd;
+} FwRequest;
+
+
+typedef struct FwQuery
+{
+   uint8_t qiP[4];
+   int qPort;
+   bool ipv6;          // the address is in qiP6 instead of qiP
+   uint8_t qiP6[16];
+} FwQuery;
+
+
+// An IPv6 address as two host-order halves, so addresses compare as
+// numbers a word at a time
+typedef struct FwAddr6
+{
+   uint64_t hi;
+   uint64_t lo;
+} FwAddr6;
+
+
+typedef struct FwRule
+{
+   char* RawCmd;       // in the string arena once the rule is stored
+   bool ipv6;
+   union {
+       // Either family's bounds; only the IPv4 ones are read while ipv6 is false
+       struct {
+           uint8_t ip1[4];
+           uint8_t ip2[4];
+       };
+       struct {
+           uint8_t ip6lo[16];
+           uint8_t ip6hi[16];
+       };
+   };
+   int port1;
+   int port2;
+
+
+   QuerySet queries;   // accepted queries, QUERY6_WORDS words each for IPv6
+} FwRule;
+
+
+// Shared state and its locks:
+//
+//   rule set       readers take none (see rule_set.h); writers serialize
+//                  on the rule set's own write lock
+//   history        history_lock, around each append and each chunk of R
+//   query sets     query_lock_for(rule), one of QUERY_LOCK_STRIPES
+//
+// Lock order: no thread holds two of these at once, and none is held
+// while waiting on a socket. A thread that has pinned a version with
+// rule_set_acquire() may take any of them. The slab and pool queue locks
+// are leaves.
+extern pthread_mutex_t history_lock;
+
+// The lock guarding fwRule's accepted queries
+pthread_mutex_t* query_lock_for(const FwRule* fwRule);
+
+
+// Sets up the locks, rule set and request history
+void server_init(int history, const char* historyLog);
+
+// True if the parsed rule's addresses and ports are in order
+bool isValidRule(FwRule* fwRule);
+
+// Parse the arguments of an A or D and of a C command, printing why when
+// they are malformed
+bool process_rule_cmd(char* text, FwRule* fwRule);
+bool process_query_cmd(const char* text, FwQuery* fwQuery);
+
+// Records a check against one rule set version; true if accepted
+struct RuleSet;
+bool check_query(const struct RuleSet* rs, uint32_t ip, uint16_t port);
+bool check_query6(const struct RuleSet* rs, FwAddr6 ip, uint16_t port);
+
+// Runs one command and appends its response text to out
+void process_request(char* buffer, FwBuf* out);
+
+// Runs count binary check entries and sets bit i of bitmap when check i
+// is accepted
+void process_checks(const uint8_t* entries, uint32_t count, uint8_t* bitmap);
+
+// Opens a TCP socket listening on port, or exits. The socket takes IPv6
+// and IPv4 clients when the host has IPv6. With reusePort several sockets
+// may listen on the same port and the kernel spreads connections over them.
+int open_listener(int port, int backlog, bool reusePort);
+
+// Serves one client until it closes or its one-shot exchange is done.
+// conn's buffers are reused, so a worker can pass the same one each time.
+void serve_connection(int sockfd, FwConn* conn);
+
+// Serves clients from non-blocking sockets on pcmd->threads epoll loops.
+// ENGINE_EPOLL loops share one listener; ENGINE_REUSEPORT gives each loop
+// its own and pins the loop's thread to a CPU.
+void run_epoll(CmdArg* pcmd);
+
+// Reads each epoll loop's accepted connections; false if no loops run
+bool epoll_get_counters(LoopCounters* counters);
+
+// Serves clients on pcmd->threads io_uring rings, submitting and reaping
+// in batches. Returns false at once when io_uring cannot be used.
+bool run_uring(CmdArg* pcmd);
+
+// Reads the rings' syscall and completion counts; false if no rings run
+bool uring_get_counters(UringCounters* counters);
+
+// Serves clients on pcmd->threads preallocated worker threads
+void run_pool(CmdArg* pcmd);
+
+// Reads the pool's queue depth and busy workers; false if no pool runs
+bool pool_get_counters(PoolCounters* counters);
+
+
+// Packs a dotted-quad address into a host-order 32-bit value
+static inline uint32_t pack_ip(const uint8_t ip[4])
+{
+   return ((uint32_t)ip[0] << 24) | ((uint32_t)ip[1] << 16) |
+          ((uint32_t)ip[2] << 8) | (uint32_t)ip[3];
+}
+
+// Packs a 16-byte IPv6 address into two host-order halves
+static inline FwAddr6 pack_ip6(const uint8_t ip[16])
+{
+   FwAddr6 addr = { 0, 0 };
+   for (int i = 0; i < 8; i++) {
+       addr.hi = (addr.hi << 8) | ip[i];
+       addr.lo = (addr.lo << 8) | ip[i + 8];
+   }
+   return addr;
+}
+
+
+#endif
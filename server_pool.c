@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "server_helper.h"
+#include "stats.h"
+
+
+// Accepted sockets waiting for a worker. The acceptor blocks while the
+// queue is full, which leaves further connections in the kernel backlog.
+typedef struct PoolQueue
+{
+   int* fds;
+   size_t cap;
+   size_t head;
+   size_t count;
+   pthread_mutex_t mutex;
+   pthread_cond_t notEmpty;
+   pthread_cond_t notFull;
+} PoolQueue;
+
+
+static PoolQueue queue;
+static int workerCount = 0;
+static atomic_size_t queuedCount;
+static atomic_int busyWorkers;
+
+
+static void queue_push(int fd)
+{
+   pthread_mutex_lock(&queue.mutex);
+   while (queue.count == queue.cap) {
+       pthread_cond_wait(&queue.notFull, &queue.mutex);
+   }
+   queue.fds[(queue.head + queue.count) % queue.cap] = fd;
+   queue.count++;
+   atomic_store(&queuedCount, queue.count);
+   pthread_cond_signal(&queue.notEmpty);
+   pthread_mutex_unlock(&queue.mutex);
+}
+
+
+static int queue_pop(void)
+{
+   pthread_mutex_lock(&queue.mutex);
+   while (queue.count == 0) {
+       pthread_cond_wait(&queue.notEmpty, &queue.mutex);
+   }
+   int fd = queue.fds[queue.head];
+   queue.head = (queue.head + 1) % queue.cap;
+   queue.count--;
+   atomic_store(&queuedCount, queue.count);
+   pthread_cond_signal(&queue.notFull);
+   pthread_mutex_unlock(&queue.mutex);
+   return fd;
+}
+
+
+static void* pool_worker(void* arg)
+{
+   // Each worker keeps its buffers from one client to the next
+   FwConn conn;
+   conn_init(&conn);
+   while (true) {
+       int fd = queue_pop();
+       atomic_fetch_add(&busyWorkers, 1);
+       serve_connection(fd, &conn);
+       atomic_fetch_sub(&busyWorkers, 1);
+   }
+   return NULL;
+}
+
+
+bool pool_get_counters(PoolCounters* counters)
+{
+   if (workerCount == 0) {
+       return false;
+   }
+   counters->workers = workerCount;
+   counters->busy = atomic_load(&busyWorkers);
+   counters->queued = atomic_load(&queuedCount);
+   counters->capacity = queue.cap;
+   return true;
+}
+
+
+void run_pool(CmdArg* pcmd)
+{
+   printf("running pool on port %d with %d workers\n", pcmd->port, pcmd->threads);
+   int sockfd = open_listener(pcmd->port, pcmd->backlog, false);
+
+   queue.cap = pcmd->queue_depth;
+   queue.fds = malloc(queue.cap * sizeof(int));
+   if (queue.fds == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   queue.head = 0;
+   queue.count = 0;
+   pthread_mutex_init(&queue.mutex, NULL);
+   pthread_cond_init(&queue.notEmpty, NULL);
+   pthread_cond_init(&queue.notFull, NULL);
+
+   // All workers exist up front; nothing is created per connection
+   for (int i = 0; i < pcmd->threads; i++) {
+       pthread_t thread_id;
+       if (pthread_create(&thread_id, NULL, pool_worker, NULL) != 0) {
+           perror("Failed to create thread");
+           exit(1);
+       }
+       pthread_detach(thread_id);
+   }
+   workerCount = pcmd->threads;
+
+   while (1) {
+       int newsockfd = accept(sockfd, NULL, NULL);
+       if (newsockfd < 0) {
+           if (errno != EINTR) {
+               perror("ERROR on accept");
+           }
+           continue;
+       }
+       stats_count(STAT_CONN_ACCEPTED, 1);
+       queue_push(newsockfd);
+   }
+}
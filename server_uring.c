@@ -0,0 +1,539 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server_helper.h"
+#include "conn.h"
+#include "stats.h"
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+
+#define URING_ENTRIES 1024       // submission queue slots per ring
+#define URING_BUFFERS 256        // registered read buffers per ring
+#define URING_BUFFER_SIZE 4096
+
+// Headers from before 5.19 lack it; such kernels fail the first accept
+// with EINVAL and get single-shot accepts from then on
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+// The low bits of a completion's user_data say which operation finished;
+// the rest is the UringConn it was for
+#define OP_ACCEPT 0
+#define OP_READ   1
+#define OP_WRITE  2
+#define OP_CLOSE  3
+#define OP_MASK   3
+
+
+typedef struct UringConn
+{
+   int fd;
+   int buffer;        // registered buffer reads land in, or -1 to read into conn.in
+   size_t outSent;    // bytes of conn.out already written
+   FwConn conn;
+} UringConn;
+
+
+// One io_uring instance and the thread that drives it. Every ring keeps a
+// multishot accept armed on the shared listener, and each connection has
+// at most one operation in flight: a read, the writes of the responses
+// that read produced, then the next read.
+typedef struct Uring
+{
+   int fd;
+   int listenfd;
+   bool multishot;    // accept stays armed across connections
+
+   unsigned* sqHead;
+   unsigned* sqTail;
+   unsigned sqMask;
+   unsigned sqEntries;
+   unsigned sqLocalTail;    // entries filled, published on the next enter
+   struct io_uring_sqe* sqes;
+   unsigned* cqHead;
+   unsigned* cqTail;
+   unsigned cqMask;
+   struct io_uring_cqe* cqes;
+   struct io_uring_cqe* backlog;    // completions taken off the ring, not yet handled
+   size_t backlogLen;
+   size_t backlogCap;
+
+   char* buffers;           // URING_BUFFERS registered buffers, or NULL
+   int freeBuffers[URING_BUFFERS];
+   int freeCount;
+
+   atomic_uint_least64_t enters;       // written by the ring's thread only
+   atomic_uint_least64_t completions;
+   pthread_t thread;
+} Uring;
+
+
+static Uring* allRings = NULL;
+static int ringCount = 0;
+
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+   return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+   return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+   return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+
+// Only the ring's thread writes its counters
+static void bump(atomic_uint_least64_t* value, uint64_t n)
+{
+   atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                         memory_order_relaxed);
+}
+
+
+// Checks that the kernel has every operation the rings use. io_uring
+// itself dates from 5.1, but reads, writes and closes only came in 5.6,
+// as did the probe; older kernels would fail every read with EINVAL.
+static bool ring_supported(int fd)
+{
+   static const int ops[] = {
+       IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_CLOSE
+   };
+   size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe* probe = calloc(1, size);
+   if (probe == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   bool supported = uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+   for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+       supported = ops[i] <= probe->last_op &&
+                   (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+   }
+   free(probe);
+   return supported;
+}
+
+
+// Creates the ring and maps its queues. Returns false, with errno set,
+// when the kernel has no io_uring, lacks an operation the rings use or
+// does not let this process use it.
+static bool ring_open(Uring* ring)
+{
+   struct io_uring_params params;
+   memset(&params, 0, sizeof(params));
+   ring->fd = uring_setup(URING_ENTRIES, &params);
+   if (ring->fd < 0) {
+       return false;
+   }
+   if (!ring_supported(ring->fd)) {
+       close(ring->fd);
+       errno = ENOSYS;
+       return false;
+   }
+
+   size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+   size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+   if (single && cqSize > sqSize) {
+       sqSize = cqSize;
+   }
+   char* sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring->fd, IORING_OFF_SQ_RING);
+   char* cq = single ? sq : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 ring->fd, IORING_OFF_CQ_RING);
+   ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQES);
+   if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+       close(ring->fd);
+       return false;
+   }
+
+   ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+   ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+   ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+   ring->sqEntries = params.sq_entries;
+   ring->sqLocalTail = *ring->sqTail;
+   // Slot i of the submission array always names sqe i
+   unsigned* array = (unsigned*)(sq + params.sq_off.array);
+   for (unsigned i = 0; i < params.sq_entries; i++) {
+       array[i] = i;
+   }
+   ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+   ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+   ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+   return true;
+}
+
+
+// Registers the read buffers. Without them, reads go straight into each
+// connection's input buffer, which costs the kernel a page pin per read.
+static void ring_register_buffers(Uring* ring)
+{
+   ring->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (ring->buffers == MAP_FAILED) {
+       ring->buffers = NULL;
+       return;
+   }
+   struct iovec iov[URING_BUFFERS];
+   for (int i = 0; i < URING_BUFFERS; i++) {
+       iov[i].iov_base = ring->buffers + (size_t)i * URING_BUFFER_SIZE;
+       iov[i].iov_len = URING_BUFFER_SIZE;
+   }
+   if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) {
+       perror("WARNING could not register io_uring buffers");
+       munmap(ring->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+       ring->buffers = NULL;
+       return;
+   }
+   for (int i = 0; i < URING_BUFFERS; i++) {
+       ring->freeBuffers[i] = URING_BUFFERS - 1 - i;
+   }
+   ring->freeCount = URING_BUFFERS;
+}
+
+
+// Hands the filled entries to the kernel and, with wait, blocks until at
+// least one completion is ready. This is the ring's only syscall. Returns
+// false when the kernel takes nothing until completions are reaped.
+static bool ring_enter(Uring* ring, bool wait)
+{
+   __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+   while (true) {
+       unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+       unsigned submit = ring->sqLocalTail - head;
+       if (submit == 0 && !wait) {
+           return true;
+       }
+       bump(&ring->enters, 1);
+       int n = uring_enter(ring->fd, submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+       if (n >= 0) {
+           return true;
+       }
+       // EBUSY: the completion queue overflowed; EAGAIN: the kernel is
+       // short of memory for requests until some complete
+       if (errno == EBUSY || errno == EAGAIN) {
+           return false;
+       }
+       if (errno != EINTR) {
+           perror("ERROR in io_uring_enter");
+           exit(1);
+       }
+   }
+}
+
+
+// Moves every ready completion off the ring into the backlog, so the
+// kernel has room to post more and takes submissions again. The handlers
+// run from ring_loop only, never from inside another handler.
+static void ring_stash(Uring* ring)
+{
+   unsigned head = *ring->cqHead;
+   unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+   bump(&ring->completions, tail - head);
+   for (; head != tail; head++) {
+       if (ring->backlogLen == ring->backlogCap) {
+           ring->backlogCap = ring->backlogCap ? ring->backlogCap * 2 : 2 * URING_ENTRIES;
+           ring->backlog = realloc(ring->backlog, ring->backlogCap * sizeof(struct io_uring_cqe));
+           if (ring->backlog == NULL) {
+               printf("Memory allocation failed\n");
+               exit(1);
+           }
+       }
+       ring->backlog[ring->backlogLen++] = ring->cqes[head & ring->cqMask];
+   }
+   __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+
+static struct io_uring_sqe* get_sqe(Uring* ring)
+{
+   // A full queue is submitted before more is added, reaping completions
+   // first when the kernel will not take it until they are
+   while (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+       if (!ring_enter(ring, false)) {
+           ring_stash(ring);
+       }
+   }
+   struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+   ring->sqLocalTail++;
+   memset(sqe, 0, sizeof(*sqe));
+   return sqe;
+}
+
+
+static void arm_accept(Uring* ring)
+{
+   struct io_uring_sqe* sqe = get_sqe(ring);
+   sqe->opcode = IORING_OP_ACCEPT;
+   sqe->fd = ring->listenfd;
+   sqe->ioprio = ring->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+   sqe->user_data = OP_ACCEPT;
+}
+
+
+static void arm_read(Uring* ring, UringConn* uc)
+{
+   struct io_uring_sqe* sqe = get_sqe(ring);
+   sqe->fd = uc->fd;
+   sqe->off = (uint64_t)-1;
+   if (uc->buffer >= 0) {
+       sqe->opcode = IORING_OP_READ_FIXED;
+       sqe->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)uc->buffer * URING_BUFFER_SIZE);
+       sqe->buf_index = (uint16_t)uc->buffer;
+   } else {
+       sqe->opcode = IORING_OP_READ;
+       sqe->addr = (uint64_t)(uintptr_t)buf_reserve(&uc->conn.in, URING_BUFFER_SIZE);
+   }
+   sqe->len = URING_BUFFER_SIZE;
+   sqe->user_data = (uint64_t)(uintptr_t)uc | OP_READ;
+}
+
+
+static void arm_write(Uring* ring, UringConn* uc)
+{
+   struct io_uring_sqe* sqe = get_sqe(ring);
+   sqe->opcode = IORING_OP_WRITE;
+   sqe->fd = uc->fd;
+   sqe->off = (uint64_t)-1;
+   sqe->addr = (uint64_t)(uintptr_t)(uc->conn.out.data + uc->outSent);
+   sqe->len = (uint32_t)(uc->conn.out.len - uc->outSent);
+   sqe->user_data = (uint64_t)(uintptr_t)uc | OP_WRITE;
+}
+
+
+static void arm_close(Uring* ring, UringConn* uc)
+{
+   struct io_uring_sqe* sqe = get_sqe(ring);
+   sqe->opcode = IORING_OP_CLOSE;
+   sqe->fd = uc->fd;
+   sqe->user_data = (uint64_t)(uintptr_t)uc | OP_CLOSE;
+}
+
+
+static void on_accept(Uring* ring, const struct io_uring_cqe* cqe)
+{
+   if (!(cqe->flags & IORING_CQE_F_MORE)) {
+       // Multishot accept is 5.19+; older kernels reject it outright
+       if (cqe->res == -EINVAL && ring->multishot) {
+           ring->multishot = false;
+       }
+       arm_accept(ring);
+   }
+   if (cqe->res < 0) {
+       if (cqe->res != -EINVAL && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+           fprintf(stderr, "ERROR on accept: %s\n", strerror(-cqe->res));
+       }
+       return;
+   }
+   UringConn* uc = malloc(sizeof(UringConn));
+   if (uc == NULL) {
+       close(cqe->res);
+       return;
+   }
+   uc->fd = cqe->res;
+   uc->buffer = ring->freeCount > 0 ? ring->freeBuffers[--ring->freeCount] : -1;
+   uc->outSent = 0;
+   conn_init(&uc->conn);
+   stats_count(STAT_CONN_ACCEPTED, 1);
+   arm_read(ring, uc);
+}
+
+
+// Flushes the responses, or reads on or closes when there are none. No
+// read is armed while commands are paused, so out stays bounded.
+static void after_output(Uring* ring, UringConn* uc)
+{
+   while (true) {
+       if (uc->outSent < uc->conn.out.len) {
+           arm_write(ring, uc);
+           return;
+       }
+       uc->conn.out.len = 0;
+       uc->outSent = 0;
+       if (uc->conn.closing) {
+           arm_close(ring, uc);
+           return;
+       }
+       if (!uc->conn.paused) {
+           break;
+       }
+       // Run the commands held back while out was full
+       conn_process(&uc->conn, false);
+   }
+   arm_read(ring, uc);
+}
+
+
+static void on_read(Uring* ring, UringConn* uc, int res)
+{
+   if (res == -EINTR || res == -EAGAIN) {
+       arm_read(ring, uc);
+       return;
+   }
+   if (res < 0) {
+       arm_close(ring, uc);
+       return;
+   }
+   if (uc->buffer >= 0) {
+       char* dst = buf_reserve(&uc->conn.in, res);
+       memcpy(dst, ring->buffers + (size_t)uc->buffer * URING_BUFFER_SIZE, res);
+   }
+   uc->conn.in.len += res;
+   conn_process(&uc->conn, res == 0);
+   after_output(ring, uc);
+}
+
+
+static void on_write(Uring* ring, UringConn* uc, int res)
+{
+   if (res == -EINTR || res == -EAGAIN) {
+       arm_write(ring, uc);
+       return;
+   }
+   if (res < 0) {
+       arm_close(ring, uc);
+       return;
+   }
+   uc->outSent += res;
+   after_output(ring, uc);
+}
+
+
+static void on_close(Uring* ring, UringConn* uc, int res)
+{
+   // A close the ring could not do must not leak the descriptor
+   if (res < 0) {
+       close(uc->fd);
+   }
+   if (uc->buffer >= 0) {
+       ring->freeBuffers[ring->freeCount++] = uc->buffer;
+   }
+   conn_free(&uc->conn);
+   free(uc);
+   stats_count(STAT_CONN_CLOSED, 1);
+}
+
+
+static void* ring_loop(void* arg)
+{
+   Uring* ring = arg;
+   arm_accept(ring);
+
+   // Each pass submits everything queued since the last one and waits for
+   // completions in the same syscall, then handles every completion ready.
+   // They are taken off the ring first, so the kernel can move overflowed
+   // completions in while this batch runs; handlers that have to reap
+   // more to submit add to the same batch.
+   while (true) {
+       ring_enter(ring, true);
+       ring_stash(ring);
+       for (size_t i = 0; i < ring->backlogLen; i++) {
+           struct io_uring_cqe cqe = ring->backlog[i];
+           UringConn* uc = (UringConn*)(uintptr_t)(cqe.user_data & ~(uint64_t)OP_MASK);
+           switch (cqe.user_data & OP_MASK) {
+           case OP_ACCEPT: on_accept(ring, &cqe); break;
+           case OP_READ:   on_read(ring, uc, cqe.res); break;
+           case OP_WRITE:  on_write(ring, uc, cqe.res); break;
+           case OP_CLOSE:  on_close(ring, uc, cqe.res); break;
+           }
+       }
+       ring->backlogLen = 0;
+   }
+   return NULL;
+}
+
+
+bool uring_get_counters(UringCounters* counters)
+{
+   if (ringCount == 0) {
+       return false;
+   }
+   counters->rings = ringCount;
+   counters->enters = 0;
+   counters->completions = 0;
+   counters->registered = allRings[0].buffers != NULL;
+   for (int i = 0; i < ringCount; i++) {
+       counters->enters += atomic_load_explicit(&allRings[i].enters, memory_order_relaxed);
+       counters->completions += atomic_load_explicit(&allRings[i].completions, memory_order_relaxed);
+   }
+   return true;
+}
+
+
+bool run_uring(CmdArg* pcmd)
+{
+   Uring* rings = calloc(pcmd->threads, sizeof(Uring));
+   if (rings == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (int i = 0; i < pcmd->threads; i++) {
+       if (!ring_open(&rings[i])) {
+           if (i == 0) {
+               perror("io_uring unavailable");
+               free(rings);
+               return false;
+           }
+           perror("ERROR creating io_uring");
+           exit(1);
+       }
+       ring_register_buffers(&rings[i]);
+       rings[i].multishot = true;
+   }
+
+   printf("running io_uring on port %d with %d rings\n", pcmd->port, pcmd->threads);
+   int listenfd = open_listener(pcmd->port, pcmd->backlog, false);
+   for (int i = 0; i < pcmd->threads; i++) {
+       rings[i].listenfd = listenfd;
+   }
+   allRings = rings;
+   ringCount = pcmd->threads;
+
+   for (int i = 1; i < pcmd->threads; i++) {
+       if (pthread_create(&rings[i].thread, NULL, ring_loop, &rings[i]) != 0) {
+           perror("Failed to create thread");
+           exit(1);
+       }
+   }
+   ring_loop(&rings[0]);
+   return true;
+}
+
+#else
+
+bool run_uring(CmdArg* pcmd)
+{
+   printf("io_uring is only available on Linux\n");
+   return false;
+}
+
+
+bool uring_get_counters(UringCounters* counters)
+{
+   return false;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+
+#define SLAB_CHUNK 65536
+
+// String arena size classes; the largest holds MAX_FW_CMD bytes
+#define STR_CLASSES 5
+#define STR_MIN_SHIFT 4
+
+
+static FwSlab strSlabs[STR_CLASSES] = {
+   FW_SLAB_INIT(16),
+   FW_SLAB_INIT(32),
+   FW_SLAB_INIT(64),
+   FW_SLAB_INIT(128),
+   FW_SLAB_INIT(256)
+};
+
+
+void* slab_alloc(FwSlab* slab)
+{
+   // Objects hold a free-list link while free, so keep them pointer-aligned
+   size_t size = (slab->objSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+   pthread_mutex_lock(&slab->lock);
+   void* obj = slab->freeList;
+   if (obj != NULL) {
+       slab->freeList = *(void**)obj;
+   } else {
+       if (slab->chunkLeft == 0) {
+           slab->chunkLeft = SLAB_CHUNK / size;
+           slab->chunk = malloc(slab->chunkLeft * size);
+           if (slab->chunk == NULL) {
+               printf("Memory allocation failed\n");
+               exit(1);
+           }
+       }
+       obj = slab->chunk;
+       slab->chunk += size;
+       slab->chunkLeft--;
+   }
+   pthread_mutex_unlock(&slab->lock);
+   return obj;
+}
+
+
+void slab_free(FwSlab* slab, void* obj)
+{
+   if (obj == NULL) {
+       return;
+   }
+   pthread_mutex_lock(&slab->lock);
+   *(void**)obj = slab->freeList;
+   slab->freeList = obj;
+   pthread_mutex_unlock(&slab->lock);
+}
+
+
+// Smallest class that holds len bytes
+static FwSlab* str_class(size_t len)
+{
+   int c = 0;
+   while (c < STR_CLASSES - 1 && len > ((size_t)1 << (c + STR_MIN_SHIFT))) {
+       c++;
+   }
+   return &strSlabs[c];
+}
+
+
+char* slab_strdup(const char* str)
+{
+   size_t len = strlen(str) + 1;
+   FwSlab* slab = str_class(len);
+   if (len > slab->objSize) {
+       // Longer than any command; should not happen
+       len = slab->objSize;
+   }
+   char* copy = slab_alloc(slab);
+   memcpy(copy, str, len);
+   copy[len - 1] = '\0';
+   return copy;
+}
+
+
+void slab_strfree(char* str)
+{
+   if (str != NULL) {
+       slab_free(str_class(strlen(str) + 1), str);
+   }
+}
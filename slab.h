@@ -0,0 +1,35 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+
+// Pool of fixed-size objects carved out of large chunks.
+//
+// Freed objects go on a free list and are handed out again before a new
+// chunk is taken, so a steady mix of adds and deletes stops touching the
+// general-purpose allocator. Chunks are never given back. Every call
+// locks the slab's own mutex.
+typedef struct FwSlab
+{
+   size_t objSize;
+   void* freeList;
+   char* chunk;        // unused tail of the newest chunk
+   size_t chunkLeft;   // objects left in that tail
+   pthread_mutex_t lock;
+} FwSlab;
+
+#define FW_SLAB_INIT(size) { (size), NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER }
+
+
+void* slab_alloc(FwSlab* slab);
+void slab_free(FwSlab* slab, void* obj);
+
+// Copies str into the string arena: size-classed slabs, so command text
+// takes roughly its own length rather than a full MAX_FW_CMD buffer
+char* slab_strdup(const char* str);
+void slab_strfree(char* str);
+
+
+#endif
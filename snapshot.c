@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "fw_buf.h"
+#include "rule_set.h"
+#include "stats.h"
+
+
+// Version 2 added IPv6 rules; a version 1 file reads as one without any
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+
+
+typedef struct SnapshotHeader
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t byteOrder;
+   uint64_t rules;
+   uint64_t queries;
+   uint64_t textSize;
+   uint64_t checksum;   // over the body
+   uint64_t rules6;     // 0 in version 1
+   uint64_t keyWords;   // 0 in version 1, where it equals queries
+} SnapshotHeader;
+
+
+// Where each section starts, relative to the body
+typedef struct SnapshotLayout
+{
+   size_t ipLo, ipHi, ip6, portLo, portHi;
+   size_t textOffsets, text;
+   size_t queryOffsets, keys;
+   size_t size;
+} SnapshotLayout;
+
+
+static const char snapshotMagic[8] = "FWSNAP";
+static atomic_bool writing = false;
+
+
+static size_t align8(size_t n)
+{
+   return (n + 7) & ~(size_t)7;
+}
+
+
+// rules4 IPv4 rules come first, then rules6 IPv6 ones. Without IPv6 rules
+// this is the version 1 layout.
+static void layout(SnapshotLayout* l, size_t rules4, size_t rules6, size_t textSize, size_t keyWords)
+{
+   size_t rules = rules4 + rules6;
+   l->ipLo = 0;
+   l->ipHi = l->ipLo + align8(rules4 * sizeof(uint32_t));
+   l->ip6 = l->ipHi + align8(rules4 * sizeof(uint32_t));
+   l->portLo = l->ip6 + rules6 * 4 * sizeof(uint64_t);
+   l->portHi = l->portLo + align8(rules * sizeof(uint16_t));
+   l->textOffsets = l->portHi + align8(rules * sizeof(uint16_t));
+   l->text = l->textOffsets + (rules + 1) * sizeof(uint64_t);
+   l->queryOffsets = l->text + align8(textSize);
+   l->keys = l->queryOffsets + (rules + 1) * sizeof(uint64_t);
+   l->size = l->keys + keyWords * sizeof(uint64_t);
+}
+
+
+// The rule at position i of the snapshot, IPv4 ones first
+static FwRule* rule_at(const RuleSet* rs, size_t i)
+{
+   return i < rs->table.count ? rs->table.cold[i] : rs->table6->cold[i - rs->table.count];
+}
+
+
+// FNV-1a over 64-bit words; the body is always a whole number of words
+static uint64_t checksum(const uint8_t* data, size_t size)
+{
+   uint64_t h = 0xcbf29ce484222325ull;
+   for (size_t i = 0; i + 8 <= size; i += 8) {
+       uint64_t w;
+       memcpy(&w, data + i, sizeof(w));
+       h = (h ^ w) * 0x100000001b3ull;
+   }
+   return h;
+}
+
+
+// Copies the current version's rules and queries into body. Each rule's
+// query set is copied under its query lock, so checks wait at most for one
+// rule's copy.
+static void capture(FwBuf* body, SnapshotHeader* header)
+{
+   const RuleSet* rs = rule_set_acquire();
+   const RuleTable* table = &rs->table;
+   const RuleTable6* table6 = rs->table6;
+   size_t n4 = table->count, n6 = table6->count, n = n4 + n6;
+   size_t textSize = 0;
+   for (size_t i = 0; i < n; i++) {
+       textSize += strlen(rule_at(rs, i)->RawCmd) + 1;
+   }
+
+   SnapshotLayout l;
+   layout(&l, n4, n6, textSize, 0);
+   buf_reserve(body, l.size);
+   memset(body->data, 0, l.size);
+   body->len = l.size;
+   memcpy(body->data + l.ipLo, table->ip_lo, n4 * sizeof(uint32_t));
+   memcpy(body->data + l.ipHi, table->ip_hi, n4 * sizeof(uint32_t));
+   for (size_t i = 0; i < n6; i++) {
+       uint64_t words[4] = { table6->ip_lo[i].hi, table6->ip_lo[i].lo,
+                             table6->ip_hi[i].hi, table6->ip_hi[i].lo };
+       memcpy(body->data + l.ip6 + i * sizeof(words), words, sizeof(words));
+   }
+   memcpy(body->data + l.portLo, table->port_lo, n4 * sizeof(uint16_t));
+   memcpy(body->data + l.portLo + n4 * sizeof(uint16_t), table6->port_lo, n6 * sizeof(uint16_t));
+   memcpy(body->data + l.portHi, table->port_hi, n4 * sizeof(uint16_t));
+   memcpy(body->data + l.portHi + n4 * sizeof(uint16_t), table6->port_hi, n6 * sizeof(uint16_t));
+
+   uint64_t off = 0;
+   for (size_t i = 0; i < n; i++) {
+       size_t len = strlen(rule_at(rs, i)->RawCmd) + 1;
+       memcpy(body->data + l.textOffsets + i * sizeof(uint64_t), &off, sizeof(off));
+       memcpy(body->data + l.text + off, rule_at(rs, i)->RawCmd, len);
+       off += len;
+   }
+   memcpy(body->data + l.textOffsets + n * sizeof(uint64_t), &off, sizeof(off));
+
+   // Keys go last since their number is only known once they are copied.
+   // Query offsets count words, QUERY6_WORDS per IPv6 query.
+   uint64_t queries = 0, words = 0;
+   for (size_t i = 0; i < n; i++) {
+       FwRule* fwRule = rule_at(rs, i);
+       size_t width = fwRule->ipv6 ? QUERY6_WORDS : 1;
+       memcpy(body->data + l.queryOffsets + i * sizeof(uint64_t), &words, sizeof(words));
+       pthread_mutex_t* queryLock = query_lock_for(fwRule);
+       uint64_t held = stats_lock(queryLock, STAT_QUERY_WAIT);
+       const QuerySet* set = &fwRule->queries;
+       buf_append(body, set->keys, set->count * width * sizeof(uint64_t));
+       queries += set->count;
+       words += set->count * width;
+       stats_unlock(queryLock, STAT_QUERY_HOLD, held);
+   }
+   memcpy(body->data + l.queryOffsets + n * sizeof(uint64_t), &words, sizeof(words));
+   rule_set_release();
+
+   memset(header, 0, sizeof(*header));
+   memcpy(header->magic, snapshotMagic, sizeof(header->magic));
+   header->version = SNAPSHOT_VERSION;
+   header->byteOrder = SNAPSHOT_BYTE_ORDER;
+   header->rules = n4;
+   header->rules6 = n6;
+   header->queries = queries;
+   header->keyWords = words;
+   header->textSize = textSize;
+   header->checksum = checksum((const uint8_t*)body->data, body->len);
+}
+
+
+static bool write_fully(int fd, const void* data, size_t len)
+{
+   const char* p = data;
+   while (len > 0) {
+       ssize_t n = write(fd, p, len);
+       if (n < 0) {
+           if (errno == EINTR) {
+               continue;
+           }
+           return false;
+       }
+       p += n;
+       len -= n;
+   }
+   return true;
+}
+
+
+// Writes to a temporary file next to path and renames it into place
+static bool write_snapshot(const char* path, const SnapshotHeader* header, const FwBuf* body)
+{
+   char tmp[4096];
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+   int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+       return false;
+   }
+   bool ok = write_fully(fd, header, sizeof(*header)) &&
+             write_fully(fd, body->data, body->len) &&
+             fsync(fd) == 0;
+   ok = close(fd) == 0 && ok;
+   if (!ok || rename(tmp, path) < 0) {
+       int saved = errno;
+       unlink(tmp);
+       errno = saved;
+       return false;
+   }
+   return true;
+}
+
+
+static void* snapshot_thread(void* arg)
+{
+   char* path = arg;
+   FwBuf body;
+   buf_init(&body);
+   SnapshotHeader header;
+   capture(&body, &header);
+   if (write_snapshot(path, &header, &body)) {
+       printf("snapshot of %llu rules and %llu queries written to %s\n",
+              (unsigned long long)(header.rules + header.rules6),
+              (unsigned long long)header.queries, path);
+   } else {
+       perror("ERROR writing snapshot");
+   }
+   buf_free(&body);
+   free(path);
+   atomic_store(&writing, false);
+   return NULL;
+}
+
+
+bool snapshot_start(const char* path)
+{
+   bool expected = false;
+   if (!atomic_compare_exchange_strong(&writing, &expected, true)) {
+       return false;
+   }
+   char* copy = strdup(path);
+   if (copy == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   pthread_t tid;
+   if (pthread_create(&tid, NULL, snapshot_thread, copy) != 0) {
+       perror("Failed to create thread");
+       free(copy);
+       atomic_store(&writing, false);
+       return false;
+   }
+   pthread_detach(tid);
+   return true;
+}
+
+
+// Compares two IPv6 addresses stored as high and low words
+static int compare_words(const uint64_t* a, const uint64_t* b)
+{
+   if (a[0] != b[0]) {
+       return a[0] < b[0] ? -1 : 1;
+   }
+   return (a[1] > b[1]) - (a[1] < b[1]);
+}
+
+
+// Writes a host-order address half as bytes, most significant first
+static void unpack_word(uint64_t word, uint8_t* out)
+{
+   for (int k = 0; k < 8; k++) {
+       out[k] = (uint8_t)(word >> (56 - 8 * k));
+   }
+}
+
+
+// Checks that every count and offset in the mapped snapshot is consistent
+static const char* validate(const uint8_t* data, size_t size, SnapshotLayout* l)
+{
+   if (size < sizeof(SnapshotHeader)) {
+       return "file too short";
+   }
+   const SnapshotHeader* header = (const SnapshotHeader*)data;
+   if (memcmp(header->magic, snapshotMagic, sizeof(header->magic)) != 0) {
+       return "not a snapshot";
+   }
+   if (header->version != 1 && header->version != SNAPSHOT_VERSION) {
+       return "unsupported snapshot version";
+   }
+   if (header->byteOrder != SNAPSHOT_BYTE_ORDER) {
+       return "snapshot written with another byte order";
+   }
+   uint64_t keyWords = header->version == 1 ? header->queries : header->keyWords;
+   if (header->version == 1 && (header->rules6 != 0 || header->keyWords != 0)) {
+       return "size mismatch";
+   }
+   size_t body = size - sizeof(SnapshotHeader);
+   // Bound the counts before they are used to size anything
+   if (header->rules > body || header->rules6 > body || header->queries > body ||
+       keyWords > body || header->textSize > body) {
+       return "size mismatch";
+   }
+   layout(l, header->rules, header->rules6, header->textSize, keyWords);
+   if (l->size != body) {
+       return "size mismatch";
+   }
+   const uint8_t* b = data + sizeof(SnapshotHeader);
+   if (checksum(b, body) != header->checksum) {
+       return "checksum mismatch";
+   }
+
+   size_t n4 = header->rules, n = n4 + header->rules6;
+   const uint32_t* ipLo = (const uint32_t*)(b + l->ipLo);
+   const uint32_t* ipHi = (const uint32_t*)(b + l->ipHi);
+   const uint64_t* ip6 = (const uint64_t*)(b + l->ip6);
+   const uint16_t* portLo = (const uint16_t*)(b + l->portLo);
+   const uint16_t* portHi = (const uint16_t*)(b + l->portHi);
+   const uint64_t* textOffsets = (const uint64_t*)(b + l->textOffsets);
+   const uint64_t* queryOffsets = (const uint64_t*)(b + l->queryOffsets);
+   const char* text = (const char*)(b + l->text);
+   if (textOffsets[0] != 0 || textOffsets[n] != header->textSize ||
+       queryOffsets[0] != 0 || queryOffsets[n] != keyWords) {
+       return "bad offsets";
+   }
+   uint64_t queries = 0;
+   for (size_t i = 0; i < n; i++) {
+       size_t width = i < n4 ? 1 : QUERY6_WORDS;
+       if (textOffsets[i + 1] <= textOffsets[i] ||
+           textOffsets[i + 1] - textOffsets[i] > MAX_FW_CMD ||
+           text[textOffsets[i + 1] - 1] != '\0' ||
+           queryOffsets[i + 1] < queryOffsets[i] ||
+           (queryOffsets[i + 1] - queryOffsets[i]) % width != 0) {
+           return "bad offsets";
+       }
+       queries += (queryOffsets[i + 1] - queryOffsets[i]) / width;
+       if (portLo[i] > portHi[i]) {
+           return "bad rule";
+       }
+       if (i < n4 ? ipLo[i] > ipHi[i]
+                  : compare_words(ip6 + (i - n4) * 4, ip6 + (i - n4) * 4 + 2) > 0) {
+           return "bad rule";
+       }
+   }
+   if (queries != header->queries) {
+       return "bad offsets";
+   }
+   return NULL;
+}
+
+
+bool snapshot_load(const char* path, size_t* rules, size_t* queries, const char** error)
+{
+   *rules = 0;
+   *queries = 0;
+   int fd = open(path, O_RDONLY);
+   if (fd < 0) {
+       *error = strerror(errno);
+       return false;
+   }
+   struct stat st;
+   if (fstat(fd, &st) < 0) {
+       *error = strerror(errno);
+       close(fd);
+       return false;
+   }
+   if (st.st_size == 0) {
+       *error = "file too short";
+       close(fd);
+       return false;
+   }
+   size_t size = st.st_size;
+   const uint8_t* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+       *error = strerror(errno);
+       return false;
+   }
+   madvise((void*)data, size, MADV_SEQUENTIAL);
+
+   SnapshotLayout l;
+   *error = validate(data, size, &l);
+   if (*error != NULL) {
+       munmap((void*)data, size);
+       return false;
+   }
+
+   const SnapshotHeader* header = (const SnapshotHeader*)data;
+   const uint8_t* b = data + sizeof(SnapshotHeader);
+   size_t n4 = header->rules, n = n4 + header->rules6;
+   const uint32_t* ipLo = (const uint32_t*)(b + l.ipLo);
+   const uint32_t* ipHi = (const uint32_t*)(b + l.ipHi);
+   const uint64_t* ip6 = (const uint64_t*)(b + l.ip6);
+   const uint16_t* portLo = (const uint16_t*)(b + l.portLo);
+   const uint16_t* portHi = (const uint16_t*)(b + l.portHi);
+   const uint64_t* textOffsets = (const uint64_t*)(b + l.textOffsets);
+   const uint64_t* queryOffsets = (const uint64_t*)(b + l.queryOffsets);
+   const char* text = (const char*)(b + l.text);
+   const uint64_t* keys = (const uint64_t*)(b + l.keys);
+
+   FwRule** stored = malloc((n ? n : 1) * sizeof(FwRule*));
+   if (stored == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (size_t i = 0; i < n; i++) {
+       FwRule parsed;
+       parsed.RawCmd = (char*)text + textOffsets[i];
+       parsed.ipv6 = i >= n4;
+       if (parsed.ipv6) {
+           const uint64_t* words = ip6 + (i - n4) * 4;
+           unpack_word(words[0], parsed.ip6lo);
+           unpack_word(words[1], parsed.ip6lo + 8);
+           unpack_word(words[2], parsed.ip6hi);
+           unpack_word(words[3], parsed.ip6hi + 8);
+       } else {
+           for (int k = 0; k < 4; k++) {
+               parsed.ip1[k] = (uint8_t)(ipLo[i] >> (24 - 8 * k));
+               parsed.ip2[k] = (uint8_t)(ipHi[i] >> (24 - 8 * k));
+           }
+       }
+       parsed.port1 = portLo[i];
+       parsed.port2 = portHi[i];
+       stored[i] = rule_set_new_rule(&parsed);
+       size_t words = queryOffsets[i + 1] - queryOffsets[i];
+       if (parsed.ipv6) {
+           query_set_load6(&stored[i]->queries, keys + queryOffsets[i], words / QUERY6_WORDS);
+       } else {
+           query_set_load(&stored[i]->queries, keys + queryOffsets[i], words);
+       }
+   }
+   // Only rules the set does not have yet are restored, and with them only
+   // their own queries. The batch moves them to the front of stored; no
+   // check can record under them yet, as nothing is served before load.
+   *rules = rule_set_add_batch(stored, n);
+   for (size_t i = 0; i < *rules; i++) {
+       *queries += stored[i]->queries.count;
+   }
+   free(stored);
+
+   munmap((void*)data, size);
+   return true;
+}
@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Binary snapshot of the rule table and every rule's accepted queries.
+//
+// The file is a fixed header followed by the table's columns laid out as
+// they are held in memory, so loading is a checksum pass over a mapping
+// plus bulk copies:
+//
+//   header    magic "FWSNAP\0\0", version, byte-order mark, IPv4 rule
+//             count n, query count, text size, body checksum, IPv6 rule
+//             count m, key words
+//   body      ip_lo[n] u32, ip_hi[n] u32, ip6[m] (4 u64: low bound high
+//             and low half, high bound high and low half), port_lo[n + m]
+//             u16, port_hi[n + m] u16, textOffsets[n + m + 1] u64, text
+//             (NUL-terminated rule text), queryOffsets[n + m + 1] u64,
+//             keys[key words] u64
+//
+// IPv4 rules come first. Query offsets count words: one per IPv4 query,
+// QUERY6_WORDS per IPv6 one. Each section starts on an 8-byte boundary.
+// Version 1 files, which had no IPv6 rules, still load. A snapshot written
+// on a machine of the other byte order is rejected rather than converted.
+
+
+// Appends the rules in the snapshot at path that the rule set does not
+// already have; *rules is how many were added and *queries how many
+// accepted queries came with them. Call before serving. Returns false
+// with *error set if the file cannot be read or is not a valid snapshot.
+bool snapshot_load(const char* path, size_t* rules, size_t* queries, const char** error);
+
+// Starts writing a snapshot of the current rules to path on a background
+// thread, replacing the file atomically when done. Checks keep running
+// while it is taken. Returns false if a snapshot is already being written.
+bool snapshot_start(const char* path);
+
+
+#endif
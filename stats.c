@@ -0,0 +1,286 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+
+#define HOLD_SAMPLE 16
+
+
+typedef struct Histogram
+{
+   atomic_uint_least64_t buckets[STATS_BUCKETS];
+   atomic_uint_least64_t count;
+   atomic_uint_least64_t sum;
+   atomic_uint_least64_t max;
+} Histogram;
+
+
+// One thread's metrics. Shards are never freed: a thread that exits hands
+// its shard to the next new thread, which keeps adding to it.
+typedef struct StatsShard
+{
+   atomic_uint_least64_t counters[STAT_COUNTERS];
+   Histogram hists[STAT_HISTS];
+   atomic_bool used;
+   unsigned lockCount;    // owner only; picks the sampled acquisitions
+   struct StatsShard* next;
+} StatsShard;
+
+
+static _Atomic(StatsShard*) shards = NULL;
+static pthread_key_t shardKey;
+static pthread_once_t shardKeyOnce = PTHREAD_ONCE_INIT;
+static __thread StatsShard* myShard = NULL;
+
+static const char* histNames[STAT_HISTS] = {
+   "A", "D", "C", "L", "R", "other commands", "check frames",
+   "history lock wait", "history lock hold", "query lock wait", "query lock hold",
+   "writer lock wait", "writer lock hold"
+};
+
+
+static void release_shard(void* arg)
+{
+   StatsShard* shard = arg;
+   atomic_store(&shard->used, false);
+}
+
+
+static void make_shard_key(void)
+{
+   pthread_key_create(&shardKey, release_shard);
+}
+
+
+static StatsShard* my_shard(void)
+{
+   if (myShard != NULL) {
+       return myShard;
+   }
+   pthread_once(&shardKeyOnce, make_shard_key);
+   StatsShard* shard;
+   for (shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+       bool expected = false;
+       if (!atomic_load_explicit(&shard->used, memory_order_relaxed) &&
+           atomic_compare_exchange_strong(&shard->used, &expected, true)) {
+           break;
+       }
+   }
+   if (shard == NULL) {
+       shard = calloc(1, sizeof(StatsShard));
+       if (shard == NULL) {
+           printf("Memory allocation failed\n");
+           exit(1);
+       }
+       atomic_store(&shard->used, true);
+       shard->next = atomic_load(&shards);
+       while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+       }
+   }
+   myShard = shard;
+   pthread_setspecific(shardKey, shard);
+   return shard;
+}
+
+
+// Only the owner writes a shard, so a relaxed load and store is enough
+static void add(atomic_uint_least64_t* value, uint64_t n)
+{
+   atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n,
+                         memory_order_relaxed);
+}
+
+
+uint64_t stats_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+void stats_count(StatCounter counter, uint64_t n)
+{
+   add(&my_shard()->counters[counter], n);
+}
+
+
+void stats_record(StatHist hist, uint64_t ns)
+{
+   Histogram* h = &my_shard()->hists[hist];
+   add(&h->buckets[stats_bucket(ns)], 1);
+   add(&h->count, 1);
+   add(&h->sum, ns);
+   if (ns > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+       atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+   }
+}
+
+
+StatHist stats_command_hist(char cmd)
+{
+   switch (cmd) {
+   case 'A': return STAT_CMD_A;
+   case 'D': return STAT_CMD_D;
+   case 'C': return STAT_CMD_C;
+   case 'L': return STAT_CMD_L;
+   case 'R': return STAT_CMD_R;
+   default:  return STAT_CMD_OTHER;
+   }
+}
+
+
+uint64_t stats_lock(pthread_mutex_t* mutex, StatHist wait)
+{
+   // An uncontended lock costs no clock reads
+   if (pthread_mutex_trylock(mutex) == 0) {
+       stats_record(wait, 0);
+   } else {
+       uint64_t start = stats_now();
+       pthread_mutex_lock(mutex);
+       stats_record(wait, stats_now() - start);
+   }
+   StatsShard* shard = my_shard();
+   return shard->lockCount++ % HOLD_SAMPLE == 0 ? stats_now() : 0;
+}
+
+
+void stats_unlock(pthread_mutex_t* mutex, StatHist hold, uint64_t token)
+{
+   uint64_t end = token != 0 ? stats_now() : 0;
+   pthread_mutex_unlock(mutex);
+   if (token != 0) {
+       stats_record(hold, end - token);
+   }
+}
+
+
+// Sum of every shard's copy of one histogram
+static void sum_hist(StatHist hist, Histogram* total)
+{
+   memset(total, 0, sizeof(*total));
+   for (StatsShard* s = atomic_load(&shards); s != NULL; s = s->next) {
+       const Histogram* h = &s->hists[hist];
+       for (int b = 0; b < STATS_BUCKETS; b++) {
+           total->buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+       }
+       total->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+       total->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+       uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+       if (max > total->max) {
+           total->max = max;
+       }
+   }
+}
+
+
+// Upper bound of the bucket holding the given fraction of the values,
+// capped at the largest value seen
+static double percentile_us(const Histogram* h, uint64_t count, double fraction)
+{
+   uint64_t rank = (uint64_t)(count * fraction);
+   uint64_t seen = 0;
+   for (int b = 0; b + 1 < STATS_BUCKETS; b++) {
+       seen += h->buckets[b];
+       if (seen > rank) {
+           uint64_t high = stats_bucket_low(b + 1) - 1;
+           return (high < h->max ? high : h->max) / 1000.0;
+       }
+   }
+   return h->max / 1000.0;
+}
+
+
+static uint64_t sum_counter(StatCounter counter)
+{
+   uint64_t total = 0;
+   for (StatsShard* s = atomic_load(&shards); s != NULL; s = s->next) {
+       total += atomic_load_explicit(&s->counters[counter], memory_order_relaxed);
+   }
+   return total;
+}
+
+
+void stats_report(FwBuf* out)
+{
+   uint64_t accepted = sum_counter(STAT_CONN_ACCEPTED);
+   uint64_t closed = sum_counter(STAT_CONN_CLOSED);
+   buf_printf(out, "Connections: %llu accepted, %llu open\n",
+              (unsigned long long)accepted,
+              (unsigned long long)(accepted > closed ? accepted - closed : 0));
+   buf_printf(out, "Checks: %llu accepted, %llu rejected\n",
+              (unsigned long long)sum_counter(STAT_CHECK_ACCEPTED),
+              (unsigned long long)sum_counter(STAT_CHECK_REJECTED));
+
+   Histogram* h = malloc(sizeof(Histogram));
+   if (h == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   for (int i = 0; i < STAT_HISTS; i++) {
+       sum_hist(i, h);
+       // Counts, sums and buckets are read separately, so use the
+       // bucket total for the percentiles
+       uint64_t count = 0;
+       for (int b = 0; b < STATS_BUCKETS; b++) {
+           count += h->buckets[b];
+       }
+       buf_printf(out, "%s: %llu, mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                  histNames[i], (unsigned long long)h->count,
+                  h->count ? h->sum / 1000.0 / h->count : 0.0,
+                  percentile_us(h, count, 0.5), percentile_us(h, count, 0.99),
+                  h->max / 1000.0);
+   }
+   free(h);
+}
+
+
+typedef struct DumpArgs
+{
+   char* path;
+   int seconds;
+} DumpArgs;
+
+
+static void* dump_thread(void* arg)
+{
+   DumpArgs* args = arg;
+   FwBuf report;
+   buf_init(&report);
+   while (true) {
+       sleep(args->seconds);
+       report.len = 0;
+       buf_printf(&report, "--- %lld\n", (long long)time(NULL));
+       stats_report(&report);
+       FILE* f = fopen(args->path, "a");
+       if (f == NULL) {
+           perror("ERROR opening stats file");
+           continue;
+       }
+       fwrite(report.data, 1, report.len, f);
+       fclose(f);
+   }
+   return NULL;
+}
+
+
+void stats_start_dump(const char* path, int seconds)
+{
+   DumpArgs* args = malloc(sizeof(DumpArgs));
+   if (args == NULL || (args->path = strdup(path)) == NULL) {
+       printf("Memory allocation failed\n");
+       exit(1);
+   }
+   args->seconds = seconds;
+   pthread_t tid;
+   if (pthread_create(&tid, NULL, dump_thread, args) != 0) {
+       perror("Failed to create thread");
+       exit(1);
+   }
+   pthread_detach(tid);
+}
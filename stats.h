@@ -0,0 +1,100 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fw_buf.h"
+
+
+// How often a server started with -m appends to its stats file
+#define STATS_DUMP_SECONDS 10
+
+
+// Server metrics, kept per thread and summed when read.
+//
+// Every thread writes only its own shard, so recording is a plain store
+// with no shared cache line. Latencies go into log-bucketed histograms in
+// the style of HdrHistogram: eight buckets per power of two of
+// nanoseconds, so any value is placed within 12.5%.
+
+typedef enum StatCounter
+{
+   STAT_CONN_ACCEPTED,
+   STAT_CONN_CLOSED,
+   STAT_CHECK_ACCEPTED,
+   STAT_CHECK_REJECTED,
+   STAT_COUNTERS
+} StatCounter;
+
+typedef enum StatHist
+{
+   STAT_CMD_A,
+   STAT_CMD_D,
+   STAT_CMD_C,
+   STAT_CMD_L,
+   STAT_CMD_R,
+   STAT_CMD_OTHER,
+   STAT_FRAME,            // one binary check frame
+   STAT_HISTORY_WAIT,     // the request history lock
+   STAT_HISTORY_HOLD,
+   STAT_QUERY_WAIT,       // the query lock stripes
+   STAT_QUERY_HOLD,
+   STAT_WRITE_WAIT,       // the rule writer lock
+   STAT_WRITE_HOLD,
+   STAT_HISTS
+} StatHist;
+
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+// Enough buckets for any 64-bit value
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+
+// The histogram bucket of value v
+static inline int stats_bucket(uint64_t v)
+{
+   if (v < STATS_SUB_BUCKETS) {
+       return (int)v;
+   }
+   int msb = 63 - __builtin_clzll(v);
+   int shift = msb - STATS_SUB_BITS;
+   return ((shift + 1) << STATS_SUB_BITS) + (int)((v >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+// Smallest value that lands in bucket b
+static inline uint64_t stats_bucket_low(int b)
+{
+   if (b < STATS_SUB_BUCKETS) {
+       return b;
+   }
+   int shift = (b >> STATS_SUB_BITS) - 1;
+   return (uint64_t)(STATS_SUB_BUCKETS + (b & (STATS_SUB_BUCKETS - 1))) << shift;
+}
+
+
+// Monotonic time in nanoseconds
+uint64_t stats_now(void);
+
+void stats_count(StatCounter counter, uint64_t n);
+void stats_record(StatHist hist, uint64_t ns);
+
+// The histogram that times a text command starting with cmd
+StatHist stats_command_hist(char cmd);
+
+// Locks mutex, recording the wait in wait. Returns what stats_unlock()
+// needs to record the hold time; hold times are sampled, one acquisition
+// in 16 per thread, to keep the clock reads off most of them.
+uint64_t stats_lock(pthread_mutex_t* mutex, StatHist wait);
+void stats_unlock(pthread_mutex_t* mutex, StatHist hold, uint64_t token);
+
+// Appends a summary of every counter and histogram, one per line
+void stats_report(FwBuf* out);
+
+// Appends a timestamped report to path every `seconds` seconds
+void stats_start_dump(const char* path, int seconds);
+
+
+#endif
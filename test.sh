@@ -7,6 +7,11 @@ client="client"
 serverOut=testServerOutput.txt
 clientOut=testClientOutput.txt
 successFile=testSuccess.txt
+historyLog=testHistory.txt
+endpointsFile=testEndpoints.txt
+ruleFile=testRules.txt
+commandsFile=testCommands.txt
+snapshotFile=testSnapshot.bin
 IPADDRESS=localhost
 PORT=2200
 
@@ -142,10 +147,382 @@ function basic_testcase(){
     return 0
 }
 
+function stream_testcase(){
+    t="stream test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    printf "Rule added\nConnection accepted\nConnection rejected\nRule: 147.188.192.41 443\nQuery: 147.188.192.41 443\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # send several commands over one connection, the first line in two parts
+    echo -en "executing client: \t"
+    { printf "A 147.188.192.41 443"; sleep 0.2; printf "\nC 147.188.192.41 443\nC 147.188.192.42 443\nL\n"; } | ./$client -k $IPADDRESS $PORT > $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function batch_testcase(){
+    t="batch test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    rm -f $commandsFile
+    printf "A 147.188.192.41 443\n\nA 147.188.193.0/24 80\nC 147.188.192.41 443\nL\n" > $commandsFile
+    printf "Rule added\nRule added\nConnection accepted\nRule: 147.188.192.41 443\nQuery: 147.188.192.41 443\nRule: 147.188.193.0/24 80\nConnection accepted\nConnection rejected\nConnection rejected\nConnection accepted\nConnection rejected\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # commands from a file with two in flight, then checks from stdin
+    # spread over three connections; responses come back in input order
+    echo -en "executing client: \t"
+    ./$client -m -w 2 $IPADDRESS $PORT $commandsFile > $clientOut 2>/dev/null &&
+    printf "C 147.188.193.7 80\nC 147.188.193.7 81\nC 147.188.194.7 80\nC 147.188.193.200 80\nC 147.188.192.41 80\n" | ./$client -m -c 3 -w 2 $IPADDRESS $PORT >> $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function snapshot_testcase(){
+    t="snapshot test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    rm -f $snapshotFile
+    printf "Rule: 147.188.192.41 443\nQuery: 147.188.192.41 443\nRule: 147.188.193.0-147.188.193.255 80-90\n\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server with no snapshot yet
+    echo -en "starting server: \t"
+    ./$server -s $snapshotFile $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    echo -en "taking snapshot: \t"
+    printf "A 147.188.192.41 443\nA 147.188.193.0-147.188.193.255 80-90\nC 147.188.192.41 443\nW\n" | ./$client -k $IPADDRESS $PORT > /dev/null 2>&1
+    sleep 1
+    killall $server > /dev/null 2> /dev/null
+    if [ ! -s $snapshotFile ]
+    then
+	echo -e "Error: no snapshot written"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # a restarted server comes back with the same rules and queries
+    echo -en "restarting server: \t"
+    sleep 1
+    ./$server -s $snapshotFile $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not restart server"
+	return -1
+    else
+	echo "OK"
+    fi
+    ./$client $IPADDRESS $PORT L > $clientOut 2>/dev/null
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function binary_testcase(){
+    t="binary test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    rm -f $endpointsFile
+    printf "147.188.192.41 443\n147.188.192.41 443\n147.188.192.42 443\n" > $endpointsFile
+    printf "147.188.192.41 443: Connection accepted\n147.188.192.41 443: Connection rejected\n147.188.192.42 443: Connection rejected\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # send all checks in one binary frame
+    echo -en "executing client: \t"
+    ./$client $IPADDRESS $PORT A 147.188.192.41 443 > /dev/null 2>&1 &&
+    ./$client -b $IPADDRESS $PORT $endpointsFile > $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function load_testcase(){
+    t="load test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    rm -f $ruleFile
+    printf "# policy\n147.188.192.41 443\n147.188.192.0-147.188.192.255 80-90\n10.0.0.0/8 22\nnot a rule\n" > $ruleFile
+    printf "Rule already exists\nConnection accepted\nConnection rejected\nRule already exists\nConnection accepted\nConnection rejected\nRule: 147.188.192.41 443\nQuery: 147.188.192.41 443\nRule: 147.188.192.0-147.188.192.255 80-90\nRule: 10.0.0.0/8 22\nQuery: 10.255.0.1 22\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server -r $ruleFile $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # rules come from the file given at startup; the same rule spelled
+    # differently, or as a prefix with host bits set, is not added twice
+    echo -en "executing client: \t"
+    printf "A 147.188.192.41-147.188.192.41 443\nC 147.188.192.41 443\nC 147.188.192.42 443\nA 10.1.2.3/8 22\nC 10.255.0.1 22\nC 11.0.0.0 22\nL\n" | ./$client -k $IPADDRESS $PORT > $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function ipv6_testcase(){
+    t="ipv6 test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    printf "Rule added\nRule added\nRule already exists\nRule added\nConnection accepted\nConnection rejected\nConnection accepted\nConnection accepted\nRule: ::ffff:147.188.192.41 443\nQuery: 147.188.192.41 443\nRule: 2001:db8::/32 443\nQuery: 2001:db8:0:1::5 443\nRule: 2001:db8::1-2001:db8::ff 80-90\nQuery: 2001:db8::10 85\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # IPv6 rules are checked apart from IPv4 ones, and an IPv4-mapped
+    # address is an IPv4 one
+    echo -en "executing client: \t"
+    printf "A 2001:db8::/32 443\nA 2001:db8::1-2001:db8::ff 80-90\nA 2001:DB8:0::5/32 443\nA ::ffff:147.188.192.41 443\nC 2001:db8:0:1::5 443\nC 2001:db9::1 443\nC 2001:db8::10 85\nC 147.188.192.41 443\nL\n" | ./$client -k ::1 $PORT > $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function history_testcase(){
+    t="history test case"
+    #cleanup
+    rm -f $serverOut
+    rm -f $clientOut
+    rm -f $successFile
+    rm -f $historyLog
+    printf "Rule added\nConnection accepted\nC 147.188.192.41 443\nR\nA 147.188.192.41 443\nC 147.188.192.41 443\n" > $successFile
+    killall $server > /dev/null 2> /dev/null
+
+    # start server
+    echo -en "starting server: \t"
+    ./$server -n 2 -l $historyLog $PORT > $serverOut  2>&1 &
+    checkConnection
+    if [ $? -ne 1 ]
+    then
+	echo -e "ERROR: could not start server"
+	return -1
+    else
+	echo "OK"
+    fi
+
+    # keep two commands in memory; R 1 2 has to read the spilled ones back
+    echo -en "executing client: \t"
+    printf "A 147.188.192.41 443\nC 147.188.192.41 443\nR\nR 1 2\n" | ./$client -k $IPADDRESS $PORT > $clientOut 2>/dev/null
+    if [ $? -ne 0 ]
+    then
+	echo -e "Error: Could not execute client"
+	killall $server > /dev/null 2> /dev/null
+	return -1
+    else
+	echo "OK"
+    fi
+    killall $server > /dev/null 2> /dev/null
+
+    echo -en "server result:     \t"
+    res=`diff $clientOut $successFile 2>&1`
+    if [ " $res" != " " ]
+    then
+	echo "Error: Server returned invalid result"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
+function parser_testcase(){
+    t="parser test case"
+    # the command parser must accept and reject what the old one did
+    echo -en "fuzzing parser: \t"
+    res=`./parser_fuzz 200000 2>&1`
+    if [ $? -ne 0 ]
+    then
+	echo "Error: $res"
+	return -1
+    else
+	echo "OK"
+    fi
+    return 0
+}
+
 # --- execution ---
 
 run interactive_testcase
 run basic_testcase
+run stream_testcase
+run batch_testcase
+run history_testcase
+run load_testcase
+run ipv6_testcase
+run snapshot_testcase
+run binary_testcase
+run parser_testcase
 #cleanup
 if [ $ret != 0 ]
 then